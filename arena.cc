@@ -0,0 +1,32 @@
+// Example ray tracing program
+// Bump allocator for data owned by a scene
+
+#include "config.h"
+#include "arena.h"
+
+#include <cstdint>
+
+Arena::~Arena ()
+{
+  for (size_t k = finalizers.size (); k-- > 0; )
+    finalizers[k].destroy (finalizers[k].p);
+  for (size_t k = 0; k < blocks.size (); k++)
+    delete[] blocks[k];
+}
+
+void *Arena::allocate (size_t size, size_t align)
+{
+  uintptr_t p = ((uintptr_t) next + align - 1) & ~(uintptr_t) (align - 1);
+  if (next == NULL || p + size > (uintptr_t) end)
+    {
+      // Requests larger than a block get a block of their own.
+      size_t n = size + align > block_size ? size + align : block_size;
+      next = new char[n];
+      end = next + n;
+      blocks.push_back (next);
+      p = ((uintptr_t) next + align - 1) & ~(uintptr_t) (align - 1);
+    }
+
+  next = (char *) (p + size);
+  return (void *) p;
+}
@@ -0,0 +1,51 @@
+// Example ray tracing program
+// Bump allocator for data owned by a scene
+
+#ifndef PTGEN_ARENA_H
+#define PTGEN_ARENA_H
+
+#include "config.h"
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Hands out memory from large blocks, which are only freed all together
+// when the arena is destroyed.  Objects created with make () are
+// destroyed at the same time, in the reverse order of their creation.
+class Arena {
+  struct Finalizer {
+    void (*destroy) (void *);
+    void *p;
+  };
+
+  std::vector<char *> blocks;
+  std::vector<Finalizer> finalizers;
+  char *next, *end;
+  size_t block_size;
+
+  template <typename T>
+  static void destroy (void *p) { static_cast <T *> (p)->~T (); }
+
+  Arena (const Arena &);
+  Arena &operator = (const Arena &);
+
+ public:
+  explicit Arena (size_t block_size_ = 65536) :
+    next (NULL), end (NULL), block_size (block_size_) {}
+  ~Arena ();
+
+  // Return SIZE bytes aligned to ALIGN, which must be a power of two.
+  void *allocate (size_t size, size_t align);
+
+  // Return a copy of X that lives as long as the arena.
+  template <typename T>
+  T *make (const T &x) {
+    T *p = new (allocate (sizeof (T), __alignof__ (T))) T (x);
+    Finalizer f = { &destroy<T>, p };
+    finalizers.push_back (f);
+    return p;
+  }
+};
+
+#endif
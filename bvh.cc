@@ -0,0 +1,193 @@
+// Example ray tracing program
+// Bounding volume hierarchy
+
+#include "config.h"
+#include "bvh.h"
+
+#include <algorithm>
+
+// Number of bins per axis used to evaluate the surface area heuristic.
+static const int n_bins = 16;
+
+static inline real coord (const Point3D &p, int axis)
+{
+  return axis == 0 ? p.x : axis == 1 ? p.y : p.z;
+}
+
+namespace {
+  struct CenterLess {
+    int axis;
+    explicit CenterLess (int axis_) : axis (axis_) {}
+
+    template <typename T> bool operator () (const T &a, const T &b) const {
+      return coord (a.center, axis) < coord (b.center, axis);
+    }
+  };
+
+  struct BinLess {
+    int axis, split;
+    real lo, scale;
+    BinLess (int axis_, real lo_, real scale_, int split_) :
+      axis (axis_), split (split_), lo (lo_), scale (scale_) {}
+
+    template <typename T> bool operator () (const T &a) const {
+      int b = (int) ((coord (a.center, axis) - lo) * scale);
+      return std::min (b, n_bins - 1) < split;
+    }
+  };
+}
+
+void BVH::build (const std::vector<Bounds> &boxes, int max_leaf_)
+{
+  clear ();
+  max_leaf = max_leaf_;
+  if (boxes.empty ())
+    return;
+
+  std::vector<Item> items (boxes.size ());
+  for (size_t k = 0; k < boxes.size (); k++)
+    {
+      items[k].bounds = boxes[k];
+      items[k].center = boxes[k].center ();
+      items[k].index = k;
+    }
+
+  nodes.reserve (2 * boxes.size ());
+  prims.reserve (boxes.size ());
+  build (items, 0, items.size (), 0);
+
+  node_data = &nodes[0], node_count = nodes.size ();
+  prim_data = &prims[0], prim_count = prims.size ();
+}
+
+int BVH::build (std::vector<Item> &items, int first, int last, int depth)
+{
+  int n = nodes.size ();
+  nodes.push_back (Node ());
+
+  Bounds bounds, centers;
+  for (int k = first; k < last; k++)
+    {
+      bounds |= items[k].bounds;
+      centers |= items[k].center;
+    }
+
+  nodes[n].bounds = bounds;
+  nodes[n].axis = 0;
+
+  int count = last - first;
+  int mid = first;
+  if (count > 1)
+    {
+      Vector3D extent = centers.hi - centers.lo;
+      int axis = extent.x >= extent.y && extent.x >= extent.z ? 0
+		 : extent.y >= extent.z ? 1 : 2;
+
+      if (coord (Point3D (extent), axis) == 0)
+	{
+	  // All centers coincide, the only way to split is arbitrarily.
+	  if (count > max_leaf)
+	    mid = first + count / 2;
+	}
+
+      else if (depth >= max_depth)
+	{
+	  mid = first + count / 2;
+	  std::nth_element (&items[first], &items[mid], &items[0] + last,
+			    CenterLess (axis));
+	}
+
+      else
+	{
+	  // Cost of a leaf is COUNT; splitting costs one traversal step
+	  // plus the children's primitives weighted by their area.
+	  real best_cost = count;
+	  int best_axis = -1, best_split = 0;
+	  real inv_area = 1 / bounds.area ();
+
+	  for (int a = 0; a < 3; a++)
+	    {
+	      real lo = coord (centers.lo, a);
+	      real size = coord (centers.hi, a) - lo;
+	      if (size == 0)
+		continue;
+
+	      Bounds bin_bounds[n_bins];
+	      int bin_count[n_bins] = { 0 };
+	      real scale = n_bins / size;
+	      for (int k = first; k < last; k++)
+		{
+		  int b = (int) ((coord (items[k].center, a) - lo) * scale);
+		  b = std::min (b, n_bins - 1);
+		  bin_bounds[b] |= items[k].bounds;
+		  bin_count[b]++;
+		}
+
+	      // Sweep from the right to get the cost of the right halves...
+	      real right_cost[n_bins];
+	      Bounds right;
+	      int right_count = 0;
+	      for (int b = n_bins - 1; b > 0; b--)
+		{
+		  right |= bin_bounds[b];
+		  right_count += bin_count[b];
+		  right_cost[b] = right.area () * right_count;
+		}
+
+	      // ... and from the left to complete the evaluation.
+	      Bounds left;
+	      int left_count = 0;
+	      for (int b = 1; b < n_bins; b++)
+		{
+		  left |= bin_bounds[b - 1];
+		  left_count += bin_count[b - 1];
+		  real cost = 1 + (left.area () * left_count + right_cost[b])
+				  * inv_area;
+		  if (cost < best_cost)
+		    best_cost = cost, best_axis = a, best_split = b;
+		}
+	    }
+
+	  if (best_axis != -1)
+	    {
+	      axis = best_axis;
+	      real lo = coord (centers.lo, axis);
+	      real scale = n_bins / (coord (centers.hi, axis) - lo);
+	      Item *p = std::partition (&items[first], &items[0] + last,
+					BinLess (axis, lo, scale, best_split));
+	      mid = p - &items[0];
+	    }
+
+	  if (mid == first || mid == last)
+	    {
+	      if (count > max_leaf)
+		{
+		  mid = first + count / 2;
+		  std::nth_element (&items[first], &items[mid],
+				    &items[0] + last, CenterLess (axis));
+		}
+	      else
+		mid = first;
+	    }
+	}
+
+      nodes[n].axis = axis;
+    }
+
+  if (mid == first)
+    {
+      nodes[n].first = prims.size ();
+      nodes[n].count = count;
+      for (int k = first; k < last; k++)
+	prims.push_back (items[k].index);
+    }
+  else
+    {
+      nodes[n].count = 0;
+      build (items, first, mid, depth + 1);
+      int second = build (items, mid, last, depth + 1);
+      nodes[n].first = second;
+    }
+
+  return n;
+}
@@ -0,0 +1,268 @@
+// Example ray tracing program
+// Bounding volume hierarchy
+
+#ifndef PTGEN_BVH_H
+#define PTGEN_BVH_H
+
+#include "config.h"
+#include "v3d.h"
+#include "geom.h"
+#include "packet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// A bounding volume hierarchy over a set of primitives, each identified
+// by its index in the vector of boxes passed to build ().  The tree is
+// built with the surface area heuristic, evaluated on a fixed number of
+// bins per axis, and is stored depth-first: the first child of an inner
+// node immediately follows it.
+class BVH {
+ public:
+  // Nodes deeper than this are split at the median, which bounds the
+  // depth of the tree and the size of the traversal stack.
+  enum { max_depth = 64 };
+
+  struct Node {
+    Bounds bounds;
+    int first;	// leaves: index in prims; inner nodes: second child
+    int count;	// number of primitives, zero for inner nodes
+    int axis;	// inner nodes: axis along which the children were split
+  };
+
+  std::vector<Node> nodes;
+  std::vector<int> prims;
+
+  // The tree that is traversed: NODES and PRIMS after build (), or
+  // arrays that live elsewhere after use (), for example in a file
+  // that is mapped in memory.
+  const Node *node_data;
+  const int *prim_data;
+  int node_count, prim_count;
+
+  BVH () : node_data (NULL), prim_data (NULL), node_count (0),
+    prim_count (0), max_leaf (4) {}
+
+  // A copy of a tree built by build () traverses its own copy of NODES
+  // and PRIMS; a copy of a tree set by use () shares the arrays.
+  BVH (const BVH &b) :
+    nodes (b.nodes), prims (b.prims), node_data (b.node_data),
+    prim_data (b.prim_data), node_count (b.node_count),
+    prim_count (b.prim_count), max_leaf (b.max_leaf) {
+    if (!nodes.empty ())
+      node_data = &nodes[0], prim_data = &prims[0];
+  }
+
+  BVH &operator = (const BVH &b) {
+    if (this != &b)
+      {
+	nodes = b.nodes, prims = b.prims;
+	node_data = b.node_data, node_count = b.node_count;
+	prim_data = b.prim_data, prim_count = b.prim_count;
+	max_leaf = b.max_leaf;
+	if (!nodes.empty ())
+	  node_data = &nodes[0], prim_data = &prims[0];
+      }
+    return *this;
+  }
+
+  // Build the tree over BOXES, with at most MAX_LEAF primitives per leaf.
+  void build (const std::vector<Bounds> &boxes, int max_leaf = 4);
+
+  // Traverse the tree in NODES and PRIMS, which must stay valid as long
+  // as it is used, instead of building one.
+  void use (const Node *nodes_, int n_nodes, const int *prims_, int n_prims) {
+    clear ();
+    node_data = nodes_, node_count = n_nodes;
+    prim_data = prims_, prim_count = n_prims;
+  }
+
+  void clear () {
+    nodes.clear ();
+    prims.clear ();
+    node_data = NULL, prim_data = NULL;
+    node_count = prim_count = 0;
+  }
+
+  // Visit the leaves hit by R in front-to-back order.  LEAF is called
+  // as leaf (prims, count) and returns true if it found an intersection;
+  // leaf.limit () returns the distance to the closest intersection found
+  // so far, and nodes farther than that are skipped.  If ANY_HIT is true,
+  // stop at the first leaf that returns true.
+  template <class Leaf>
+  bool traverse (const NormRay3D &r, Leaf &leaf, bool any_hit = false) const;
+
+  // Likewise for the rays of P whose bit is set in ACTIVE.  LEAF is
+  // called as leaf (prims, count, mask), where MASK has a bit set for
+  // each ray that enters the leaf before its closest hit so far.  The
+  // order of the visit is chosen according to the first active ray.
+  template <class Leaf>
+  void traverse (const RayPacket &p, PacketMask active, Leaf &leaf) const;
+
+ private:
+  struct Item {
+    Bounds bounds;
+    Point3D center;
+    int index;
+  };
+
+  int max_leaf;
+  int build (std::vector<Item> &items, int first, int last, int depth);
+};
+
+// Return whether R enters B before LIMIT, given the inverse of R's direction.
+static inline bool
+hit_bounds (const Bounds &b, const NormRay3D &r, const Vector3D &inv_dir,
+	    real limit)
+{
+  real tx1 = (b.lo.x - r.source.x) * inv_dir.x;
+  real tx2 = (b.hi.x - r.source.x) * inv_dir.x;
+  real tnear = tx1 < tx2 ? tx1 : tx2, tfar = tx1 < tx2 ? tx2 : tx1;
+
+  real ty1 = (b.lo.y - r.source.y) * inv_dir.y;
+  real ty2 = (b.hi.y - r.source.y) * inv_dir.y;
+  tnear = std::max (tnear, ty1 < ty2 ? ty1 : ty2);
+  tfar = std::min (tfar, ty1 < ty2 ? ty2 : ty1);
+
+  real tz1 = (b.lo.z - r.source.z) * inv_dir.z;
+  real tz2 = (b.hi.z - r.source.z) * inv_dir.z;
+  tnear = std::max (tnear, tz1 < tz2 ? tz1 : tz2);
+  tfar = std::min (tfar, tz1 < tz2 ? tz2 : tz1);
+
+  return tnear <= tfar && tfar >= 0 && tnear < limit;
+}
+
+// Return the inverse of V, replacing zero components with a large number
+// so that no infinities are involved.
+static inline Vector3D
+inverse_dir (const UnitVector3D &v)
+{
+  const real eps = 1e-20;
+  return Vector3D (1 / (std::fabs (v.x) < eps ? (v.x < 0 ? -eps : eps) : v.x),
+		   1 / (std::fabs (v.y) < eps ? (v.y < 0 ? -eps : eps) : v.y),
+		   1 / (std::fabs (v.z) < eps ? (v.z < 0 ? -eps : eps) : v.z));
+}
+
+// Return the mask of the rays in P (among those in ACTIVE) that enter B
+// before their closest hit so far, given the inverse of their directions.
+static inline PacketMask
+hit_bounds (const Bounds &b, const RayPacket &p, const real *inv_x,
+	    const real *inv_y, const real *inv_z, PacketMask active)
+{
+  bool ok[RayPacket::size];
+  for (int k = 0; k < RayPacket::size; k++)
+    {
+      real tx1 = (b.lo.x - p.ox[k]) * inv_x[k];
+      real tx2 = (b.hi.x - p.ox[k]) * inv_x[k];
+      real ty1 = (b.lo.y - p.oy[k]) * inv_y[k];
+      real ty2 = (b.hi.y - p.oy[k]) * inv_y[k];
+      real tz1 = (b.lo.z - p.oz[k]) * inv_z[k];
+      real tz2 = (b.hi.z - p.oz[k]) * inv_z[k];
+      real tnear = std::max (std::max (std::min (tx1, tx2),
+				       std::min (ty1, ty2)),
+			     std::min (tz1, tz2));
+      real tfar = std::min (std::min (std::max (tx1, tx2),
+				      std::max (ty1, ty2)),
+			    std::max (tz1, tz2));
+      ok[k] = tnear <= tfar && tfar >= 0 && tnear < p.t[k];
+    }
+
+  PacketMask mask = 0;
+  for (int k = 0; k < RayPacket::size; k++)
+    mask |= (PacketMask) ok[k] << k;
+  return mask & active;
+}
+
+template <class Leaf>
+void BVH::traverse (const RayPacket &p, PacketMask active, Leaf &leaf) const
+{
+  if (node_count == 0 || !active)
+    return;
+
+  real inv_x[RayPacket::size], inv_y[RayPacket::size], inv_z[RayPacket::size];
+  for (int k = 0; k < RayPacket::size; k++)
+    {
+      Vector3D inv = inverse_dir (UnitVector3D (p.dx[k], p.dy[k], p.dz[k]));
+      inv_x[k] = inv.x, inv_y[k] = inv.y, inv_z[k] = inv.z;
+    }
+
+  int first = 0;
+  while (!(active & (1U << first)))
+    first++;
+  bool negative[3] = { p.dx[first] < 0, p.dy[first] < 0, p.dz[first] < 0 };
+
+  int stack[max_depth + 32];
+  PacketMask stack_mask[max_depth + 32];
+  int sp = 0;
+  int n = 0;
+  PacketMask mask = active;
+  for (;;)
+    {
+      const Node &node = node_data[n];
+      mask = hit_bounds (node.bounds, p, inv_x, inv_y, inv_z, mask);
+      if (mask)
+	{
+	  if (node.count == 0)
+	    {
+	      stack_mask[sp] = mask;
+	      if (negative[node.axis])
+		stack[sp++] = n + 1, n = node.first;
+	      else
+		stack[sp++] = node.first, n = n + 1;
+	      continue;
+	    }
+
+	  leaf (&prim_data[node.first], node.count, mask);
+	}
+
+      if (sp == 0)
+	return;
+      n = stack[--sp];
+      mask = stack_mask[sp];
+    }
+}
+
+template <class Leaf>
+bool BVH::traverse (const NormRay3D &r, Leaf &leaf, bool any_hit) const
+{
+  if (node_count == 0)
+    return false;
+
+  Vector3D inv_dir = inverse_dir (r.dir);
+  bool negative[3] = { r.dir.x < 0, r.dir.y < 0, r.dir.z < 0 };
+
+  int stack[max_depth + 32];
+  int sp = 0;
+  int n = 0;
+  bool had_intersection = false;
+  for (;;)
+    {
+      const Node &node = node_data[n];
+      if (hit_bounds (node.bounds, r, inv_dir, leaf.limit ()))
+	{
+	  if (node.count == 0)
+	    {
+	      // Visit first the child that is closer to the ray source.
+	      if (negative[node.axis])
+		stack[sp++] = n + 1, n = node.first;
+	      else
+		stack[sp++] = node.first, n = n + 1;
+	      continue;
+	    }
+
+	  if (leaf (&prim_data[node.first], node.count))
+	    {
+	      had_intersection = true;
+	      if (any_hit)
+		return true;
+	    }
+	}
+
+      if (sp == 0)
+	return had_intersection;
+      n = stack[--sp];
+    }
+}
+
+#endif
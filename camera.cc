@@ -0,0 +1,60 @@
+// Example ray tracing program
+// Keyframed camera paths for animations
+
+#include "config.h"
+#include "camera.h"
+
+#include <sstream>
+#include <string>
+
+Ray3D CameraPath::at (real t) const
+{
+  int n = keys.size ();
+  if (n == 1 || t <= 0)
+    return keys.front ();
+  if (t >= 1)
+    return keys.back ();
+
+  real pos = t * (n - 1);
+  int k = (int) pos;
+  real f = pos - k;
+  const Ray3D &a = keys[k], &b = keys[k + 1];
+  return Ray3D (a.source + (b.source - a.source) * f,
+		a.dir + (b.dir - a.dir) * f);
+}
+
+bool CameraPath::read (std::istream &is)
+{
+  std::string line;
+  while (std::getline (is, line))
+    {
+      std::istringstream iss (line);
+      char c;
+      if (!(iss >> c) || c == '#')
+	continue;
+
+      iss.putback (c);
+      real x, y, z, dx, dy, dz;
+      if (!(iss >> x >> y >> z >> dx >> dy >> dz))
+	return false;
+      add (Point3D (x, y, z), Vector3D (dx, dy, dz));
+    }
+
+  return true;
+}
+
+CameraPath CameraPath::turntable (const Ray3D &camera, int n_keys)
+{
+  CameraPath path;
+  for (int k = 0; k <= n_keys; k++)
+    {
+      real a = 2 * M_PI * k / n_keys;
+      real c = cos (a), s = sin (a);
+      const Point3D &p = camera.source;
+      const Vector3D &d = camera.dir;
+      path.add (Point3D (p.x * c + p.z * s, p.y, p.z * c - p.x * s),
+		Vector3D (d.x * c + d.z * s, d.y, d.z * c - d.x * s));
+    }
+
+  return path;
+}
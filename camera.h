@@ -0,0 +1,41 @@
+// Example ray tracing program
+// Keyframed camera paths for animations
+
+#ifndef PTGEN_CAMERA_H
+#define PTGEN_CAMERA_H
+
+#include "config.h"
+#include "v3d.h"
+
+#include <iostream>
+#include <vector>
+
+// A sequence of camera positions and directions.  The keyframes are
+// evenly spaced in time and the camera moves linearly between them.
+class CameraPath {
+  std::vector<Ray3D> keys;
+
+ public:
+  void add (const Ray3D &camera) { keys.push_back (camera); }
+  void add (const Point3D &source, const Vector3D &dir) {
+    keys.push_back (Ray3D (source, dir));
+  }
+
+  int size () const { return keys.size (); }
+  bool empty () const { return keys.empty (); }
+
+  // Return the camera at time T, from 0 (the first keyframe) to 1
+  // (the last one).
+  Ray3D at (real t) const;
+
+  // Read keyframes from IS, one per line as six numbers: the position
+  // followed by the direction.  Empty lines and lines starting with #
+  // are skipped.  Return false if there is a syntax error.
+  bool read (std::istream &is);
+
+  // Return a path that makes CAMERA turn once around the vertical axis
+  // through the origin, in N_KEYS steps.
+  static CameraPath turntable (const Ray3D &camera, int n_keys = 72);
+};
+
+#endif
@@ -0,0 +1,443 @@
+// Example ray tracing program
+// Rendering with worker processes connected through pipes
+
+#include "config.h"
+#include "scene.h"
+#include "thread.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// The coordinator and the workers talk through a pair of pipes, using
+// lines of text:
+//
+//   JOB W H SX SY SZ DX DY DZ MAX_REF AA_DEPTH AA_THRESHOLD
+//       MIN_CONTRIBUTION ROULETTE SEED WAVEFRONT
+//	sent once to each worker: the size of the image, the camera and
+//	the options.
+//   TILE X0 Y0 X1 Y1
+//	asks for a tile.  The worker answers with the same line followed
+//	by the 3 * (X1 - X0) * (Y1 - Y0) bytes of the pixels, in the order
+//	in which the tiles were asked for.
+//   END
+//	ends the job.  The worker answers with a line
+//	DONE PIXELS PRIMARY_RAYS SHADOW_RAYS SECONDARY_RAYS.
+
+// Reads lines and blocks of bytes from a file descriptor.
+class PipeReader {
+  int fd;
+  char buf[65536];
+  size_t pos, len;
+
+  bool fill ();
+
+ public:
+  explicit PipeReader (int fd_) : fd (fd_), pos (0), len (0) {}
+
+  int get_fd () const { return fd; }
+
+  // Return whether there is data that was read but not consumed yet.
+  bool buffered () const { return pos < len; }
+
+  bool read_line (std::string &line);
+  bool read (void *p, size_t n);
+};
+
+bool PipeReader::fill ()
+{
+  ssize_t n;
+  do
+    n = ::read (fd, buf, sizeof (buf));
+  while (n == -1 && errno == EINTR);
+
+  pos = 0;
+  len = n > 0 ? n : 0;
+  return n > 0;
+}
+
+bool PipeReader::read_line (std::string &line)
+{
+  line.clear ();
+  for (;;)
+    {
+      if (pos == len && !fill ())
+	return false;
+
+      char *nl = (char *) std::memchr (buf + pos, '\n', len - pos);
+      size_t end = nl ? nl - buf : len;
+      line.append (buf + pos, end - pos);
+      pos = end;
+      if (nl)
+	{
+	  pos++;
+	  return true;
+	}
+    }
+}
+
+bool PipeReader::read (void *p, size_t n)
+{
+  char *dest = static_cast <char *> (p);
+  while (n > 0)
+    {
+      if (pos == len && !fill ())
+	return false;
+
+      size_t chunk = std::min (n, len - pos);
+      std::memcpy (dest, buf + pos, chunk);
+      dest += chunk, pos += chunk, n -= chunk;
+    }
+
+  return true;
+}
+
+static bool write_all (int fd, const void *p, size_t n)
+{
+  const char *src = static_cast <const char *> (p);
+  while (n > 0)
+    {
+      ssize_t done = ::write (fd, src, n);
+      if (done == -1 && errno == EINTR)
+	continue;
+      if (done <= 0)
+	return false;
+      src += done, n -= done;
+    }
+
+  return true;
+}
+
+static bool write_all (int fd, const std::string &s)
+{
+  return write_all (fd, s.data (), s.size ());
+}
+
+static std::string tile_line (const Tile &t)
+{
+  std::ostringstream oss;
+  oss << "TILE " << t.x0 << ' ' << t.y0 << ' ' << t.x1 << ' ' << t.y1
+      << '\n';
+  return oss.str ();
+}
+
+bool Scene::work (int in, int out) const
+{
+  PipeReader r (in);
+  std::string line, cmd;
+  if (!r.read_line (line))
+    return false;
+
+  // The worker renders one tile at a time, so one thread is enough.
+  int w, h, wavefront;
+  real sx, sy, sz, dx, dy, dz;
+  RenderOptions options (5, 1);
+  std::istringstream iss (line);
+  iss >> cmd >> w >> h >> sx >> sy >> sz >> dx >> dy >> dz
+      >> options.max_ref >> options.aa_depth >> options.aa_threshold
+      >> options.min_contribution >> options.roulette >> options.seed
+      >> wavefront;
+  if (!iss || cmd != "JOB")
+    return false;
+
+  options.wavefront = wavefront;
+  Ray3D camera (Point3D (sx, sy, sz), Vector3D (dx, dy, dz));
+
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+  Image m;
+  while (r.read_line (line))
+    {
+      std::istringstream iss (line);
+      Tile t;
+      iss >> cmd;
+      if (cmd == "END")
+	{
+	  std::ostringstream oss;
+	  oss << "DONE " << last_stats.pixels << ' '
+	      << last_stats.primary_rays << ' ' << last_stats.shadow_rays
+	      << ' ' << last_stats.secondary_rays << '\n';
+	  return write_all (out, oss.str ());
+	}
+
+      iss >> t.x0 >> t.y0 >> t.x1 >> t.y1;
+      if (!iss || cmd != "TILE" || t.x0 < 0 || t.y0 < 0
+	  || t.x1 <= t.x0 || t.y1 <= t.y0 || t.x1 > w || t.y1 > h)
+	return false;
+
+      int tw = t.x1 - t.x0, th = t.y1 - t.y0;
+      if (m.get_image_data () == NULL
+	  || m.get_width () != tw || m.get_height () != th)
+	m.set_size (tw, th);
+
+      render_rect (camera, w, h, t.x0, t.y0, m, options);
+      if (!write_all (out, tile_line (t))
+	  || !write_all (out, m.get_image_data (), 3 * tw * th))
+	return false;
+    }
+
+  return false;
+}
+
+// A worker process, and the tiles that it was asked for and has not
+// sent back yet.
+struct Worker {
+  pid_t pid;
+  int to;
+  PipeReader from;
+  std::deque<Tile> sent;
+
+  Worker (pid_t pid_, int to_, int from_) :
+    pid (pid_), to (to_), from (from_) {}
+  ~Worker () {
+    close (to);
+    close (from.get_fd ());
+    waitpid (pid, NULL, 0);
+  }
+};
+
+// Start the program in WORKERS with --worker or, if COMMAND is not NULL,
+// run COMMAND through the shell, with pipes to its standard input and
+// output.  Return NULL if it cannot be started.
+static Worker *spawn (const WorkerOptions &workers, const char *command)
+{
+  std::vector<const char *> argv;
+  argv.push_back (workers.program);
+  argv.insert (argv.end (), workers.args.begin (), workers.args.end ());
+  argv.push_back ("--worker");
+  argv.push_back (NULL);
+
+  int down[2], up[2];
+  if (pipe (down) == -1)
+    return NULL;
+  if (pipe (up) == -1)
+    {
+      close (down[0]), close (down[1]);
+      return NULL;
+    }
+
+  // Our ends of the pipes must not leak into the other workers.
+  fcntl (down[1], F_SETFD, FD_CLOEXEC);
+  fcntl (up[0], F_SETFD, FD_CLOEXEC);
+
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      dup2 (down[0], 0);
+      dup2 (up[1], 1);
+      close (down[0]), close (down[1]);
+      close (up[0]), close (up[1]);
+      if (command)
+	execl ("/bin/sh", "sh", "-c", command, (char *) NULL);
+      else
+	execvp (workers.program, const_cast <char **> (&argv[0]));
+      _exit (127);
+    }
+
+  close (down[0]);
+  close (up[1]);
+  if (pid == -1)
+    {
+      close (down[1]);
+      close (up[0]);
+      return NULL;
+    }
+
+  return new Worker (pid, down[1], up[0]);
+}
+
+// Give W tiles from TODO until it has two in flight, so that it never
+// waits for the next one.  Return false if W cannot be written to.
+static bool feed (Worker &w, std::deque<Tile> &todo)
+{
+  while (w.sent.size () < 2 && !todo.empty ())
+    {
+      Tile t = todo.front ();
+      if (!write_all (w.to, tile_line (t)))
+	return false;
+      todo.pop_front ();
+      w.sent.push_back (t);
+    }
+
+  return true;
+}
+
+// Read the next tile from W into M.
+static bool receive (Worker &w, Image &m)
+{
+  std::string line;
+  if (w.sent.empty () || !w.from.read_line (line)
+      || line + '\n' != tile_line (w.sent.front ()))
+    return false;
+
+  const Tile &t = w.sent.front ();
+  int tw = t.x1 - t.x0;
+  unsigned char *data = m.get_image_data ();
+  for (int y = t.y0; y < t.y1; y++)
+    if (!w.from.read (data + (size_t) 3 * ((size_t) y * m.get_width () + t.x0),
+		      3 * tw))
+      return false;
+
+  w.sent.pop_front ();
+  return true;
+}
+
+void Scene::render (const Ray3D &camera, Image &m,
+		    const RenderOptions &options,
+		    const WorkerOptions &workers) const
+{
+  double start = now ();
+  int w = m.get_width ();
+  int h = m.get_height ();
+
+  // A worker that dies must not kill us when we write to it.
+  void (*old_sigpipe) (int) = signal (SIGPIPE, SIG_IGN);
+
+  std::ostringstream job;
+  job.precision (17);
+  job << "JOB " << w << ' ' << h << ' '
+      << camera.source.x << ' ' << camera.source.y << ' '
+      << camera.source.z << ' ' << camera.dir.x << ' '
+      << camera.dir.y << ' ' << camera.dir.z << ' '
+      << options.max_ref << ' ' << options.aa_depth << ' '
+      << options.aa_threshold << ' ' << options.min_contribution << ' '
+      << options.roulette << ' ' << options.seed << ' '
+      << options.wavefront << '\n';
+
+  std::vector<Worker *> live;
+  int n_workers = workers.local + workers.commands.size ();
+  for (int k = 0; k < n_workers; k++)
+    {
+      const char *command = k < workers.local ? NULL
+			    : workers.commands[k - workers.local];
+      Worker *wk = spawn (workers, command);
+      if (wk && write_all (wk->to, job.str ()))
+	live.push_back (wk);
+      else
+	delete wk;
+    }
+
+  // The tiles are the same as when rendering in a single process.
+  std::deque<Tile> todo;
+  for (int y0 = 0; y0 < h; y0 += tile_size)
+    for (int x0 = 0; x0 < w; x0 += tile_size)
+      todo.push_back (Tile (x0, y0, std::min (x0 + tile_size, w),
+			    std::min (y0 + tile_size, h)));
+
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+
+  size_t remaining = todo.size ();
+  bool lost = true;
+  while (remaining > 0 && !live.empty ())
+    {
+      // After a worker is lost, the others may be waiting for tiles.
+      for (size_t k = 0; lost && k < live.size (); k++)
+	feed (*live[k], todo);
+      lost = false;
+
+      // Serve first the workers whose answers are already buffered.
+      std::vector<size_t> ready;
+      for (size_t k = 0; k < live.size (); k++)
+	if (live[k]->from.buffered ())
+	  ready.push_back (k);
+
+      if (ready.empty ())
+	{
+	  std::vector<struct pollfd> fds (live.size ());
+	  for (size_t k = 0; k < live.size (); k++)
+	    {
+	      fds[k].fd = live[k]->from.get_fd ();
+	      fds[k].events = POLLIN;
+	      fds[k].revents = 0;
+	    }
+
+	  if (poll (&fds[0], fds.size (), -1) == -1)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      break;
+	    }
+
+	  for (size_t k = 0; k < live.size (); k++)
+	    if (fds[k].revents)
+	      ready.push_back (k);
+	}
+
+      for (size_t n = ready.size (); n-- > 0; )
+	{
+	  Worker *wk = live[ready[n]];
+	  bool ok = receive (*wk, m);
+	  if (ok)
+	    {
+	      remaining--;
+	      std::cerr << '.';
+	      ok = feed (*wk, todo);
+	    }
+	  if (ok)
+	    continue;
+
+	  // Give the tiles of the dead worker to the others.
+	  std::cerr << "\nLost a worker." << std::endl;
+	  todo.insert (todo.begin (), wk->sent.begin (), wk->sent.end ());
+	  kill (wk->pid, SIGTERM);
+	  delete wk;
+	  live.erase (live.begin () + ready[n]);
+	  lost = true;
+	}
+    }
+
+  // Without workers, render whatever is left here.
+  if (!todo.empty () && live.empty ())
+    {
+      Image tile;
+      for (size_t k = 0; k < todo.size (); k++)
+	{
+	  const Tile &t = todo[k];
+	  tile.set_size (t.x1 - t.x0, t.y1 - t.y0);
+	  render_rect (camera, w, h, t.x0, t.y0, tile, options);
+	  for (int y = t.y0; y < t.y1; y++)
+	    std::memcpy (m.get_image_data ()
+			 + (size_t) 3 * ((size_t) y * w + t.x0),
+			 tile.get_image_data ()
+			 + (size_t) 3 * (y - t.y0) * (t.x1 - t.x0),
+			 3 * (t.x1 - t.x0));
+	  std::cerr << '.';
+	}
+    }
+
+  // Collect the counts of the workers and wait for them to exit.
+  for (size_t k = 0; k < live.size (); k++)
+    {
+      std::string line, cmd;
+      RenderStats s;
+      if (write_all (live[k]->to, "END\n")
+	  && live[k]->from.read_line (line))
+	{
+	  std::istringstream iss (line);
+	  iss >> cmd >> s.pixels >> s.primary_rays >> s.shadow_rays
+	      >> s.secondary_rays;
+	  if (iss && cmd == "DONE")
+	    last_stats += s;
+	}
+
+      delete live[k];
+    }
+
+  signal (SIGPIPE, old_sigpipe);
+  last_stats.seconds = now () - start;
+  std::cerr << std::endl;
+}
@@ -3,17 +3,92 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
 
 #include "config.h"
 #include "v3d.h"
 #include "geom.h"
+#include "bvh.h"
+#include "stats.h"
 
 real Intersection::inf = INFINITY;
 
+// Not INFINITY, so that -ffast-math can be used.
+const real Bounds::huge = 1e30;
+
+Bounds &Bounds::operator |= (const Point3D &p)
+{
+  lo.x = std::min (lo.x, p.x), hi.x = std::max (hi.x, p.x);
+  lo.y = std::min (lo.y, p.y), hi.y = std::max (hi.y, p.y);
+  lo.z = std::min (lo.z, p.z), hi.z = std::max (hi.z, p.z);
+  return *this;
+}
+
+Bounds &Bounds::operator |= (const Bounds &b)
+{
+  lo.x = std::min (lo.x, b.lo.x), hi.x = std::max (hi.x, b.hi.x);
+  lo.y = std::min (lo.y, b.lo.y), hi.y = std::max (hi.y, b.hi.y);
+  lo.z = std::min (lo.z, b.lo.z), hi.z = std::max (hi.z, b.hi.z);
+  return *this;
+}
+
+Bounds &Bounds::operator &= (const Bounds &b)
+{
+  lo.x = std::max (lo.x, b.lo.x), hi.x = std::min (hi.x, b.hi.x);
+  lo.y = std::max (lo.y, b.lo.y), hi.y = std::min (hi.y, b.hi.y);
+  lo.z = std::max (lo.z, b.lo.z), hi.z = std::min (hi.z, b.hi.z);
+  return *this;
+}
+
+void RayPacket::set_ray (int k, const Ray3D &r)
+{
+  NormRay3D nr = r.normalize ();
+  ox[k] = nr.source.x, oy[k] = nr.source.y, oz[k] = nr.source.z;
+  dx[k] = nr.dir.x, dy[k] = nr.dir.y, dz[k] = nr.dir.z;
+  set_hit (k, INFINITY, NULL, NULL);
+  set_prim (k, -1, 0, 0);
+}
+
 Entity::~Entity ()
 {
 }
 
+PacketMask Entity::intersect (RayPacket &p, PacketMask active,
+			      const Object &o, real tlim) const
+{
+  PacketMask hits = 0;
+  for (int k = 0; k < RayPacket::size; k++)
+    if (active & (1U << k))
+      {
+	Intersection i (p, k);
+	if (intersect (i, o, tlim))
+	  {
+	    p.set_hit (k, i.t, i.entity, i.object, i.from_inside);
+	    p.set_prim (k, i.prim, i.bu, i.bv, i.part);
+	    hits |= 1U << k;
+	  }
+      }
+
+  return hits;
+}
+
+bool Entity::occludes (const NormRay3D &r, const Object &o, real tmax) const
+{
+  Intersection i (r);
+  i.t = tmax;
+  return intersect (i, o);
+}
+
+Bounds Entity::get_bounds () const
+{
+  return Bounds::infinite ();
+}
+
+Bounds Entity::get_surface_bounds () const
+{
+  return get_bounds ();
+}
+
 bool Plane::inside (const Point3D &p) const
 {
   return Vector3D (p) * normal + d >= 0;
@@ -21,6 +96,7 @@ bool Plane::inside (const Point3D &p) const
 
 bool Plane::intersect (Intersection &i, const Object &o, real tlim) const
 {
+  STATS_TEST (STATS_PLANE);
   const NormRay3D &r = i.r;
   real denom = r.dir * normal;
   if (denom == 0.0)
@@ -29,6 +105,7 @@ bool Plane::intersect (Intersection &i, const Object &o, real tlim) const
   real t = -(Vector3D (r.source) * normal + d) / denom;
   if (t > tlim && t < i.t)
     {
+      STATS_HIT (STATS_PLANE);
       i.t = t;
       i.entity = this;
       i.object = &o;
@@ -38,26 +115,109 @@ bool Plane::intersect (Intersection &i, const Object &o, real tlim) const
     return false;
 }
 
-real Plane::texture_u (const Point3D &p) const
+PacketMask Plane::intersect (RayPacket &p, PacketMask active,
+			     const Object &o, real tlim) const
 {
-  Vector3D v (normal.y, -normal.x, normal.z);
-  return (p * v);
+  real t[RayPacket::size];
+  bool ok[RayPacket::size];
+  for (int k = 0; k < RayPacket::size; k++)
+    {
+      real denom = p.dx[k] * normal.x + p.dy[k] * normal.y
+		   + p.dz[k] * normal.z;
+      real dist = p.ox[k] * normal.x + p.oy[k] * normal.y
+		  + p.oz[k] * normal.z + d;
+      t[k] = -dist / (denom == 0.0 ? 1 : denom);
+      ok[k] = denom != 0.0 && t[k] > tlim && t[k] < p.t[k];
+    }
+
+  PacketMask hits = 0;
+  for (int k = 0; k < RayPacket::size; k++)
+    if (ok[k] && (active & (1U << k)))
+      {
+	p.set_hit (k, t[k], this, &o);
+	hits |= 1U << k;
+      }
+
+  STATS_ADD (tests[STATS_PLANE], __builtin_popcount (active));
+  STATS_ADD (hits[STATS_PLANE], __builtin_popcount (hits));
+  return hits;
 }
 
-real Plane::texture_v (const Point3D &p) const
+bool Plane::occludes (const NormRay3D &r, const Object &o, real tmax) const
 {
-  Vector3D v (normal.x, -normal.z, normal.y);
-  return (p * v);
+  STATS_TEST (STATS_PLANE);
+  real denom = r.dir * normal;
+  if (denom == 0.0)
+    return false;
+
+  real t = -(Vector3D (r.source) * normal + d) / denom;
+  if (t > 0 && t < tmax)
+    {
+      STATS_HIT (STATS_PLANE);
+      return true;
+    }
+  else
+    return false;
 }
 
-UnitVector3D Plane::get_normal (const Point3D &p) const
+// Only planes perpendicular to an axis have bounds along that axis.
+static int plane_axis (const UnitVector3D &n)
 {
-  return normal;
+  if (n.y == 0 && n.z == 0)
+    return 0;
+  else if (n.x == 0 && n.z == 0)
+    return 1;
+  else if (n.x == 0 && n.y == 0)
+    return 2;
+  else
+    return -1;
 }
 
-UnitVector3D Plane::get_normal (const Intersection &i) const
+static void set_coord (Point3D &p, int axis, real x)
 {
-  return normal;
+  if (axis == 0)
+    p.x = x;
+  else if (axis == 1)
+    p.y = x;
+  else
+    p.z = x;
+}
+
+Bounds Plane::get_bounds () const
+{
+  Bounds b = Bounds::infinite ();
+  int axis = plane_axis (normal);
+  if (axis == -1)
+    return b;
+
+  real n = axis == 0 ? normal.x : axis == 1 ? normal.y : normal.z;
+  set_coord (n > 0 ? b.lo : b.hi, axis, -d / n);
+  return b;
+}
+
+Bounds Plane::get_surface_bounds () const
+{
+  Bounds b = Bounds::infinite ();
+  int axis = plane_axis (normal);
+  if (axis == -1)
+    return b;
+
+  real n = axis == 0 ? normal.x : axis == 1 ? normal.y : normal.z;
+  set_coord (b.lo, axis, -d / n);
+  set_coord (b.hi, axis, -d / n);
+  return b;
+}
+
+real Plane::texture_u (const Point3D &p) const
+{
+  Vector3D v (normal.y, -normal.x, normal.z);
+  return (p * v);
+}
+
+real Plane::texture_v (const Point3D &p) const
+{
+  Vector3D v (normal.x, -normal.z, normal.y);
+  return (p * v);
 }
 
 bool Sphere::inside (const Point3D &p) const
@@ -68,6 +228,7 @@ bool Sphere::inside (const Point3D &p) const
 
 bool Sphere::intersect (Intersection &i, const Object &o, real tlim) const
 {
+  STATS_TEST (STATS_SPHERE);
   const NormRay3D &r = i.r;
   Vector3D p_to_center = center - r.source;
   real tpp = p_to_center * r.dir;
@@ -81,6 +242,7 @@ bool Sphere::intersect (Intersection &i, const Object &o, real tlim) const
   real t = from_inside ? tpp + tdc : tpp - tdc;
   if (t > tlim && t < i.t)
     {
+      STATS_HIT (STATS_SPHERE);
       i.from_inside = from_inside;
       i.t = t;
       i.entity = this;
@@ -91,9 +253,61 @@ bool Sphere::intersect (Intersection &i, const Object &o, real tlim) const
     return false;
 }
 
-UnitVector3D Sphere::get_normal (const Point3D &p) const
+PacketMask Sphere::intersect (RayPacket &p, PacketMask active,
+			      const Object &o, real tlim) const
+{
+  real t[RayPacket::size];
+  bool ok[RayPacket::size], from_inside[RayPacket::size];
+  for (int k = 0; k < RayPacket::size; k++)
+    {
+      real px = center.x - p.ox[k];
+      real py = center.y - p.oy[k];
+      real pz = center.z - p.oz[k];
+      real tpp = px * p.dx[k] + py * p.dy[k] + pz * p.dz[k];
+      real tdc2 = r2 - ((px * px + py * py + pz * pz) - tpp * tpp);
+      real tdc = sqrt (tdc2 < 0.0 ? 0 : tdc2);
+      from_inside[k] = tpp - tdc < tlim;
+      t[k] = from_inside[k] ? tpp + tdc : tpp - tdc;
+      ok[k] = tdc2 >= 0.0 && t[k] > tlim && t[k] < p.t[k];
+    }
+
+  PacketMask hits = 0;
+  for (int k = 0; k < RayPacket::size; k++)
+    if (ok[k] && (active & (1U << k)))
+      {
+	p.set_hit (k, t[k], this, &o, from_inside[k]);
+	hits |= 1U << k;
+      }
+
+  STATS_ADD (tests[STATS_SPHERE], __builtin_popcount (active));
+  STATS_ADD (hits[STATS_SPHERE], __builtin_popcount (hits));
+  return hits;
+}
+
+bool Sphere::occludes (const NormRay3D &r, const Object &o, real tmax) const
+{
+  STATS_TEST (STATS_SPHERE);
+  Vector3D p_to_center = center - r.source;
+  real tpp = p_to_center * r.dir;
+  real tdc2 = r2 - (p_to_center * p_to_center - tpp * tpp);
+  if (tdc2 < 0.0)
+    return false;
+
+  real tdc = sqrt (tdc2);
+  real t = tpp - tdc < 0 ? tpp + tdc : tpp - tdc;
+  if (t > 0 && t < tmax)
+    {
+      STATS_HIT (STATS_SPHERE);
+      return true;
+    }
+  else
+    return false;
+}
+
+Bounds Sphere::get_bounds () const
 {
-  return UnitVector3D ((p - center) / r);
+  Vector3D radius (r, r, r);
+  return Bounds (center + -radius, center + radius);
 }
 
 real Sphere::texture_u (const Point3D &p) const
@@ -123,6 +337,31 @@ UnitVector3D ReverseSphere::get_normal (const Point3D &p) const
   return UnitVector3D ((center - p) / r);
 }
 
+// The surface is bounded, but the inside is not.
+Bounds ReverseSphere::get_bounds () const
+{
+  return Bounds::infinite ();
+}
+
+Bounds ReverseSphere::get_surface_bounds () const
+{
+  return Sphere::get_bounds ();
+}
+
+// Testing a ray against an infinite box would overflow, and the ray
+// would hit it anyway.
+OperandBounds::OperandBounds (const Entity &e) :
+  solid (e.get_bounds ()), surface (e.get_surface_bounds ()),
+  finite (surface.is_finite ())
+{
+}
+
+inline bool OperandBounds::may_hit (const NormRay3D &r,
+				    const Vector3D &inv_dir, real limit) const
+{
+  return !finite || hit_bounds (surface, r, inv_dir, limit);
+}
+
 UnitVector3D CSGEntity::get_normal (const Intersection &i) const
 {
   std::abort ();
@@ -146,23 +385,77 @@ real CSGEntity::texture_v (const Point3D &p) const
 
 bool BoundingBox::inside (const Point3D &p) const
 {
-  return bbox.inside (p) && obj.inside (p);
+  return bbox_box.may_contain (p) && obj_box.may_contain (p)
+	 && bbox.inside (p) && obj.inside (p);
 }
 
 bool BoundingBox::intersect (Intersection &i, const Object &o, real tlim) const
 {
+  STATS_TEST (STATS_BOUNDING_BOX);
+  if (!obj_box.may_hit (i.r, inverse_dir (i.r.dir), i.t))
+    return false;
+
   Intersection i1 (i.r);
-  return (bbox.intersect (i1, o, tlim) || bbox.inside (i.r.source))
-	 && obj.intersect (i, o, tlim);
+  if (!bbox.intersect (i1, o, tlim))
+    {
+      STATS_INC (inside_calls);
+      if (!bbox.inside (i.r.source))
+	return false;
+    }
+
+  if (!obj.intersect (i, o, tlim))
+    return false;
+
+  STATS_HIT (STATS_BOUNDING_BOX);
+  return true;
+}
+
+bool BoundingBox::occludes (const NormRay3D &r, const Object &o,
+			    real tmax) const
+{
+  STATS_TEST (STATS_BOUNDING_BOX);
+  if (!obj_box.may_hit (r, inverse_dir (r.dir), tmax))
+    return false;
+
+  Intersection i1 (r);
+  if (!bbox.intersect (i1, o))
+    {
+      STATS_INC (inside_calls);
+      if (!bbox.inside (r.source))
+	return false;
+    }
+
+  if (!obj.occludes (r, o, tmax))
+    return false;
+
+  STATS_HIT (STATS_BOUNDING_BOX);
+  return true;
+}
+
+Bounds BoundingBox::get_bounds () const
+{
+  return obj_box.solid & bbox_box.solid;
+}
+
+// Hits are only looked for on OBJ, wherever the ray enters BBOX.
+Bounds BoundingBox::get_surface_bounds () const
+{
+  return obj_box.surface;
 }
 
 bool Difference::inside (const Point3D &p) const
 {
-  return obj.inside (p) && !bite.inside (p);
+  return obj_box.may_contain (p) && obj.inside (p)
+	 && !(bite_box.may_contain (p) && bite.inside (p));
 }
 
 bool Difference::intersect (Intersection &i, const Object &o, real tlim) const
 {
+  STATS_TEST (STATS_DIFFERENCE);
+  Vector3D inv_dir = inverse_dir (i.r.dir);
+  if (!obj_box.may_hit (i.r, inv_dir, i.t))
+    return false;
+
   Intersection i1 (i);
   bool had_intersection = obj.intersect (i1, o, tlim);
   if (!had_intersection)
@@ -170,27 +463,108 @@ bool Difference::intersect (Intersection &i, const Object &o, real tlim) const
 
   // controllare...
   Point3D p = i1.r (i1.t);
-  if (bite.inside (p))
-    return bite.intersect (i, o, i1.t);
+  if (bite_box.may_contain (p))
+    {
+      STATS_INC (inside_calls);
+      if (bite.inside (p))
+	{
+	  if (!bite_box.may_hit (i.r, inv_dir, i.t)
+	      || !bite.intersect (i, o, i1.t))
+	    return false;
+
+	  STATS_HIT (STATS_DIFFERENCE);
+	  return true;
+	}
+    }
 
+  STATS_HIT (STATS_DIFFERENCE);
   i = i1;
   return true;
 }
 
+Bounds Difference::get_bounds () const
+{
+  return obj_box.solid;
+}
+
+// The surface is made of that of OBJ and of the part of BITE's that is
+// inside OBJ.
+Bounds Difference::get_surface_bounds () const
+{
+  return obj_box.surface | (bite_box.surface & obj_box.solid);
+}
+
 bool Union::inside (const Point3D &p) const
 {
-  return obj.inside (p) || next.inside (p);
+  const Union *u = this;
+  for (;;)
+    {
+      if (u->obj_box.may_contain (p) && u->obj.inside (p))
+	return true;
+      if (!u->next_is_union)
+	break;
+      u = static_cast <const Union *> (&u->next);
+    }
+
+  return u->next_box.may_contain (p) && u->next.inside (p);
 }
 
+// The operands are skipped if the ray misses their box, or if their
+// box is farther than the closest hit found so far.
 bool Union::intersect (Intersection &i, const Object &o, real tlim) const
 {
-  bool had_intersection = obj.intersect (i, o, tlim);
-  const Union *this_union = this;
-  while (this_union->next_is_union)
+  STATS_TEST (STATS_UNION);
+  Vector3D inv_dir = inverse_dir (i.r.dir);
+  bool had_intersection = false;
+  const Union *u = this;
+  for (;;)
+    {
+      if (u->obj_box.may_hit (i.r, inv_dir, i.t))
+	had_intersection |= u->obj.intersect (i, o, tlim);
+      if (!u->next_is_union)
+	break;
+      u = static_cast <const Union *> (&u->next);
+    }
+
+  if (u->next_box.may_hit (i.r, inv_dir, i.t))
+    had_intersection |= u->next.intersect (i, o, tlim);
+  if (had_intersection)
+    STATS_HIT (STATS_UNION);
+  return had_intersection;
+}
+
+bool Union::occludes (const NormRay3D &r, const Object &o, real tmax) const
+{
+  STATS_TEST (STATS_UNION);
+  Vector3D inv_dir = inverse_dir (r.dir);
+  const Union *u = this;
+  for (;;)
     {
-      this_union = static_cast <const Union *> (&next);
-      had_intersection |= this_union->obj.intersect (i, o, tlim);
+      if (u->obj_box.may_hit (r, inv_dir, tmax)
+	  && u->obj.occludes (r, o, tmax))
+	{
+	  STATS_HIT (STATS_UNION);
+	  return true;
+	}
+      if (!u->next_is_union)
+	break;
+      u = static_cast <const Union *> (&u->next);
     }
 
-  return had_intersection | this_union->next.intersect (i, o, tlim);
+  if (!u->next_box.may_hit (r, inv_dir, tmax)
+      || !u->next.occludes (r, o, tmax))
+    return false;
+
+  STATS_HIT (STATS_UNION);
+  return true;
+}
+
+Bounds Union::get_bounds () const
+{
+  return obj_box.solid | next_box.solid;
+}
+
+Bounds Union::get_surface_bounds () const
+{
+  return obj_box.surface | next_box.surface;
 }
@@ -7,10 +7,58 @@
 #include <cstddef>
 #include "config.h"
 #include "v3d.h"
+#include "packet.h"
 
 class Entity;
 class Object;
 
+// An axis-aligned box.  Entities that extend to infinity report a box
+// whose coordinates are +/- Bounds::huge; a box with lo > hi is empty.
+struct Bounds {
+  static const real huge;
+
+  Point3D lo, hi;
+
+  Bounds () : lo (huge, huge, huge), hi (-huge, -huge, -huge) {}
+  Bounds (const Point3D &lo_, const Point3D &hi_) : lo (lo_), hi (hi_) {}
+
+  static Bounds infinite () {
+    return Bounds (Point3D (-huge, -huge, -huge), Point3D (huge, huge, huge));
+  }
+
+  bool is_empty () const {
+    return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z;
+  }
+  bool is_finite () const {
+    return lo.x > -huge && lo.y > -huge && lo.z > -huge
+	   && hi.x < huge && hi.y < huge && hi.z < huge;
+  }
+  bool contains (const Point3D &p) const {
+    return p.x >= lo.x && p.y >= lo.y && p.z >= lo.z
+	   && p.x <= hi.x && p.y <= hi.y && p.z <= hi.z;
+  }
+
+  Point3D center () const {
+    return Point3D ((lo.x + hi.x) * 0.5, (lo.y + hi.y) * 0.5,
+		    (lo.z + hi.z) * 0.5);
+  }
+
+  real area () const {
+    Vector3D d = hi - lo;
+    return is_empty () ? 0 : 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  Bounds &operator |= (const Point3D &p);
+  Bounds &operator |= (const Bounds &b);
+  Bounds &operator &= (const Bounds &b);
+  Bounds operator | (const Bounds &b) const { return Bounds (*this) |= b; }
+  Bounds operator & (const Bounds &b) const { return Bounds (*this) &= b; }
+};
+
+// Entities whose exact type is known to the tracer, which then calls
+// their member functions directly instead of going through the vtable.
+enum entity_kind { ENTITY_OTHER, ENTITY_SPHERE, ENTITY_PLANE };
+
 struct Intersection {
  private:
   static real inf;
@@ -22,27 +70,55 @@ struct Intersection {
   real t;
   bool from_inside;
 
+  // Set by the tracer when it knows the exact type of ENTITY.  Entities
+  // themselves never change it.
+  entity_kind kind;
+
+  // Set by entities made of many primitives, such as TriangleMesh, to
+  // the primitive that was hit and the coordinates of the hit on it;
+  // PRIM is -1 otherwise.
+  int prim;
+  real bu, bv;
+
+  // Set by entities that contain another one in a space of their own,
+  // such as Instance, to the entity that was hit in that space; PRIM,
+  // BU and BV are then those of that hit.  NULL otherwise.
+  const Entity *part;
+
   explicit Intersection (const Ray3D &r_) :
     r(r_.normalize ()), entity (NULL), object (NULL), t (inf),
-    from_inside (false) {}
+    from_inside (false), kind (ENTITY_OTHER), prim (-1), bu (0), bv (0),
+    part (NULL) {}
   explicit Intersection (const NormRay3D &r_) :
-    r(r_), entity (NULL), object (NULL), t (inf), from_inside (false) {}
+    r(r_), entity (NULL), object (NULL), t (inf), from_inside (false),
+    kind (ENTITY_OTHER), prim (-1), bu (0), bv (0), part (NULL) {}
   Intersection (const Point3D &r_, const Vector3D &v_) :
-    r(r_, v_), entity (NULL), object (NULL), t (inf), from_inside (false) {}
+    r(r_, v_), entity (NULL), object (NULL), t (inf), from_inside (false),
+    kind (ENTITY_OTHER), prim (-1), bu (0), bv (0), part (NULL) {}
   Intersection (const Point3D &r_, const UnitVector3D &v_) :
-    r(r_, v_), entity (NULL), object (NULL), t (inf), from_inside (false) {}
+    r(r_, v_), entity (NULL), object (NULL), t (inf), from_inside (false),
+    kind (ENTITY_OTHER), prim (-1), bu (0), bv (0), part (NULL) {}
   Intersection (const Ray3D &r_, real t_) :
     r(r_.source, r_.dir, t_), entity (NULL), object (NULL),
-    t (inf), from_inside (false) {}
+    t (inf), from_inside (false), kind (ENTITY_OTHER), prim (-1), bu (0),
+    bv (0), part (NULL) {}
   Intersection (const NormRay3D &r_, real t_) :
     r(r_.source, r_.dir, t_), entity (NULL), object (NULL),
-    t (inf), from_inside (false) {}
+    t (inf), from_inside (false), kind (ENTITY_OTHER), prim (-1), bu (0),
+    bv (0), part (NULL) {}
+  Intersection (const RayPacket &p, int k) :
+    r(p.get_ray (k)), entity (p.entity[k]), object (p.object[k]),
+    t (p.t[k]), from_inside (p.from_inside[k]),
+    kind ((entity_kind) p.kind[k]), prim (p.prim[k]), bu (p.bu[k]),
+    bv (p.bv[k]), part (p.part[k]) {}
   Intersection (const Intersection &i, Vector3D &dir, real t_ = 0.0) :
     r(i.r (i.t), dir, t_), entity (i.entity), object (i.object),
-    t (t_), from_inside (false) {}
+    t (t_), from_inside (false), kind (i.kind), prim (-1), bu (0),
+    bv (0), part (NULL) {}
   Intersection (const Intersection &i, UnitVector3D &dir, real t_ = 0.0) :
     r(i.r (i.t), dir, t_), entity (i.entity), object (i.object),
-    t (t_), from_inside (false) {}
+    t (t_), from_inside (false), kind (i.kind), prim (-1), bu (0),
+    bv (0), part (NULL) {}
 };
 
 class Entity {
@@ -51,12 +127,39 @@ class Entity {
   virtual bool inside (const Point3D &p) const = 0;
   virtual bool intersect (Intersection &i, const Object &o, real tlim = 0.0)
     const = 0;
+
+  // Intersect the rays of P whose bit is set in ACTIVE, and return the
+  // mask of those for which a closer hit was found.  The default calls
+  // the scalar version for each ray.
+  virtual PacketMask intersect (RayPacket &p, PacketMask active,
+				const Object &o, real tlim = 0.0) const;
+
+  // Return whether R hits the entity at a distance between zero and
+  // TMAX.  Unlike intersect, this does not look for the closest hit.
+  virtual bool occludes (const NormRay3D &r, const Object &o, real tmax)
+    const;
   virtual real texture_u (const Point3D &p) const = 0;
   virtual real texture_v (const Point3D &p) const = 0;
+  virtual real texture_u (const Intersection &i) const {
+    return texture_u (i.r (i.t));
+  }
+  virtual real texture_v (const Intersection &i) const {
+    return texture_v (i.r (i.t));
+  }
   virtual UnitVector3D get_normal (const Point3D &p) const = 0;
   virtual UnitVector3D get_normal (const Intersection &i) const {
     return get_normal (i.r (i.t));
   }
+
+  // Return a box containing the surface and every point for which
+  // inside () is true.  The default is an infinite box.
+  virtual Bounds get_bounds () const;
+
+  // Return a box containing the surface, i.e. every point where a ray
+  // can hit the entity.  This is smaller than get_bounds () for entities
+  // such as ReverseSphere whose inside is unbounded.  The default calls
+  // get_bounds ().
+  virtual Bounds get_surface_bounds () const;
 };
 
 class Plane : public Entity {
@@ -76,12 +179,20 @@ class Plane : public Entity {
   Plane (Point3D a_, Vector3D b_, Vector3D c_) :
     normal ((b_ ^ c_).normalize ()), d (-Vector3D (a_) * normal) {}
 
+  const UnitVector3D &get_normal () const { return normal; }
+  real get_offset () const { return d; }
+
   bool inside (const Point3D &p) const;
   bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  PacketMask intersect (RayPacket &p, PacketMask active, const Object &o,
+			real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
   real texture_u (const Point3D &p) const;
   real texture_v (const Point3D &p) const;
-  UnitVector3D get_normal (const Intersection &i) const;
-  UnitVector3D get_normal (const Point3D &p) const;
+  UnitVector3D get_normal (const Intersection &i) const { return normal; }
+  UnitVector3D get_normal (const Point3D &p) const { return normal; }
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
 };
 
 class Sphere : public Entity {
@@ -97,11 +208,20 @@ class Sphere : public Entity {
   Sphere (real x_, real y_, real z_, real r_) :
     center (x_, y_, z_), r (r_), r2 (r_ * r_) {}
 
+  const Point3D &get_center () const { return center; }
+  real get_radius () const { return r; }
+
   bool inside (const Point3D &p) const;
   bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  PacketMask intersect (RayPacket &p, PacketMask active, const Object &o,
+			real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
   real texture_u (const Point3D &p) const;
   real texture_v (const Point3D &p) const;
-  UnitVector3D get_normal (const Point3D &p) const;
+  UnitVector3D get_normal (const Point3D &p) const {
+    return UnitVector3D ((p - center) / r);
+  }
+  Bounds get_bounds () const;
 };
 
 class ReverseSphere : public Sphere {
@@ -113,6 +233,21 @@ class ReverseSphere : public Sphere {
 
   bool inside (const Point3D &p) const;
   UnitVector3D get_normal (const Point3D &p) const;
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
+};
+
+// The boxes of an operand of a CSG entity, which are computed when the
+// entity is created and used to skip the operand when a ray or point
+// cannot touch it.  Therefore, operands must not change afterwards.
+struct OperandBounds {
+  Bounds solid, surface;
+  bool finite;		// whether rays are tested against SURFACE
+
+  explicit OperandBounds (const Entity &e);
+
+  bool may_contain (const Point3D &p) const { return solid.contains (p); }
+  bool may_hit (const NormRay3D &r, const Vector3D &inv_dir, real limit) const;
 };
 
 class CSGEntity : public Entity {
@@ -124,38 +259,54 @@ class CSGEntity : public Entity {
 
 class BoundingBox : public CSGEntity {
   const Entity &obj, &bbox;
+  OperandBounds obj_box, bbox_box;
 
  public:
   BoundingBox (const Entity &obj_, const Entity &bbox_) :
-    obj (obj_), bbox (bbox_) {};
+    obj (obj_), bbox (bbox_), obj_box (obj_), bbox_box (bbox_) {};
 
   bool inside (const Point3D &p) const;
   bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
 };
 
 class Difference : public CSGEntity {
   const Entity &obj, &bite;
+  OperandBounds obj_box, bite_box;
 
  public:
   Difference (const Entity &obj_, const Entity &bite_) :
-    obj (obj_), bite (bite_) {};
+    obj (obj_), bite (bite_), obj_box (obj_), bite_box (bite_) {};
 
   bool inside (const Point3D &p) const;
   bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
 };
 
+// Unions of many entities are best built as balanced trees of unions
+// of nearby entities, so that the boxes of the operands can skip most
+// of them; chains are also possible, where NEXT is itself a union.
 class Union : public CSGEntity {
   const Entity &obj, &next;
   bool next_is_union;
+  OperandBounds obj_box, next_box;
 
  public:
   Union (const Entity &obj_, const Entity &next_) :
-    obj (obj_), next (next_), next_is_union (false) {};
+    obj (obj_), next (next_), next_is_union (false), obj_box (obj_),
+    next_box (next_) {};
   Union (const Entity &obj_, const Union &next_) :
-    obj (obj_), next (next_), next_is_union (true) {};
+    obj (obj_), next (next_), next_is_union (true), obj_box (obj_),
+    next_box (next_) {};
 
   bool inside (const Point3D &p) const;
   bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
 };
 
 #endif
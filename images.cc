@@ -2,32 +2,100 @@
 // Written by Paolo Bonzini, 2005
 
 #include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
 #include "config.h"
 #include "pngwrite.h"
 #include "images.h"
 #include "rand.h"
 
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 rng randf;
 
-// Scrive l'immagine nel formato identificato da FMT, attualmente
-// PNG o PPM binario.
-bool Image::write (std::ostream &os, enum image_file_format fmt) const
+std::string ImageRegion::to_string () const
+{
+  std::ostringstream oss;
+  oss << x << ' ' << y << ' ' << full_width << ' ' << full_height;
+  return oss.str ();
+}
+
+bool ImageRegion::parse (const std::string &s)
+{
+  std::istringstream iss (s);
+  ImageRegion r;
+  if (!(iss >> r.x >> r.y >> r.full_width >> r.full_height)
+      || r.x < 0 || r.y < 0 || r.full_width <= 0 || r.full_height <= 0)
+    return false;
+
+  *this = r;
+  return true;
+}
+
+// Return the header of a binary PPM file of WIDTH x HEIGHT pixels,
+// which is part REGION of a larger frame unless REGION is empty.
+static std::string ppm_header (int width, int height,
+			       const ImageRegion &region = ImageRegion ())
+{
+  std::ostringstream oss;
+  oss << "P6\n# Generated by " PACKAGE_STRING << std::endl;
+  if (!region.empty ())
+    oss << "# Region " << region.to_string () << std::endl;
+  oss << width << ' ' << height << std::endl
+      << 255 << std::endl;
+  return oss.str ();
+}
+
+bool ImageWriter::begin (int width_, int height)
 {
-  bool error = false;
-  const char *data = reinterpret_cast <const char *> (get_image_data());
+  width = width_;
+  std::string region_text = region.to_string ();
+  if (fmt == OUT_PNG)
+    ok = png.begin (os, width, height, png_options,
+		    region.empty () ? NULL : region_text.c_str ());
+  else
+    os << ppm_header (width, height, region);
+
+  return ok && os;
+}
 
+bool ImageWriter::write_rows (const unsigned char *data, int n)
+{
+  const char *row = reinterpret_cast <const char *> (data);
   if (fmt == OUT_PNG)
-    error |= !write_png (os, data, width, height);
+    ok = ok && png.write_rows (row, n);
   else
-    {
-      os << "P6\n# Generated by " PACKAGE_STRING << std::endl
-         << width << ' ' << height << std::endl
-         << 255 << std::endl;
+    os.write (row, (std::streamsize) 3 * width * n);
 
-      os.write (data, 3 * width * height);
-    }
+  return ok && os;
+}
 
-  error |= !os;
+bool ImageWriter::end ()
+{
+  if (fmt == OUT_PNG && ok)
+    ok = png.end ();
+
+  os.flush ();
+  return ok && os;
+}
+
+// Scrive l'immagine nel formato identificato da FMT, attualmente
+// PNG o PPM binario.
+bool Image::write (std::ostream &os, enum image_file_format fmt,
+		   const PngOptions &png_options,
+		   const ImageRegion &region) const
+{
+  ImageWriter out (os, fmt, png_options, region);
+  bool error = !out.begin (width, height);
+  error |= !out.write_rows (get_image_data (), height);
+  error |= !out.end ();
 
   if (error)
     std::cerr << "File output error." << std::endl;
@@ -35,3 +103,197 @@ bool Image::write (std::ostream &os, enum image_file_format fmt) const
   return error;
 }
 
+// Read the next number in the header of a PPM file from IS, skipping
+// comments.  Store the text after "# Region" in REGION if there is such
+// a comment.
+static bool read_ppm_number (std::istream &is, int &n, std::string &region)
+{
+  for (;;)
+    {
+      is >> std::ws;
+      if (is.peek () != '#')
+	break;
+
+      std::string comment;
+      std::getline (is, comment);
+      if (comment.compare (0, 8, "# Region") == 0)
+	region = comment.substr (8);
+    }
+
+  return (bool) (is >> n);
+}
+
+bool Image::read (std::istream &is, ImageRegion &region)
+{
+  std::string region_text;
+  std::vector<unsigned char> rgb;
+  int w, h;
+
+  region = ImageRegion ();
+  if (is.peek () == 'P')
+    {
+      // Only binary PPM files with one byte per component are accepted,
+      // which is what write produces.
+      char magic[2];
+      int max_value;
+      if (!is.read (magic, 2) || magic[1] != '6'
+	  || !read_ppm_number (is, w, region_text)
+	  || !read_ppm_number (is, h, region_text)
+	  || !read_ppm_number (is, max_value, region_text)
+	  || max_value != 255 || w <= 0 || h <= 0)
+	return false;
+
+      // A single whitespace character separates the header from the
+      // pixels.
+      is.get ();
+      rgb.resize ((size_t) 3 * w * h);
+      if (!is.read (reinterpret_cast <char *> (&rgb[0]), rgb.size ()))
+	return false;
+    }
+  else if (!read_png (is, rgb, w, h, region_text) || w <= 0 || h <= 0)
+    return false;
+
+  if (!region_text.empty () && !region.parse (region_text))
+    return false;
+
+  set_size (w, h);
+  std::copy (rgb.begin (), rgb.end (), image_data);
+  return true;
+}
+
+#ifdef HAVE_MMAP
+// Return whether the file open as FD holds the header HEADER followed
+// by SIZE bytes in all.
+static bool check_ppm (int fd, const std::string &header, off_t size)
+{
+  struct stat st;
+  if (fstat (fd, &st) == -1 || st.st_size != size)
+    return false;
+
+  std::string buf (header.size (), '\0');
+  return pread (fd, &buf[0], buf.size (), 0) == (ssize_t) buf.size ()
+	 && buf == header;
+}
+
+bool MappedImage::open (const char *file_name, int w, int h, bool resume)
+{
+  close ();
+  progress_name = std::string (file_name) + ".progress";
+
+  std::string header = ppm_header (w, h);
+  size_t size = header.size () + (size_t) 3 * w * h;
+
+  // When resuming, a file without a progress file is complete.
+  int fd = -1;
+  rows_done = 0;
+  if (resume && (fd = ::open (file_name, O_RDWR)) != -1)
+    {
+      if (check_ppm (fd, header, size))
+	{
+	  std::ifstream progress (progress_name.c_str ());
+	  rows_done = h;
+	  if (progress && (!(progress >> rows_done)
+			   || rows_done < 0 || rows_done > h))
+	    rows_done = 0;
+	}
+      else
+	{
+	  ::close (fd);
+	  fd = -1;
+	}
+    }
+
+  if (fd == -1)
+    {
+      fd = ::open (file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1
+	  || ::write (fd, header.data (), header.size ())
+	     != (ssize_t) header.size ()
+	  || ftruncate (fd, size) == -1)
+	{
+	  if (fd != -1)
+	    ::close (fd);
+	  return false;
+	}
+    }
+
+  mapping = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close (fd);
+  if (mapping == MAP_FAILED)
+    {
+      mapping = NULL;
+      return false;
+    }
+
+  mapping_size = size;
+  image_data = static_cast <pixel *> (mapping) + header.size ();
+  width = w;
+  height = h;
+  return rows_done == h || write_progress ();
+}
+
+void MappedImage::close ()
+{
+  if (mapping)
+    munmap (mapping, mapping_size);
+
+  mapping = NULL;
+  mapping_size = 0;
+  image_data = NULL;
+}
+
+// Write the progress file so that it is replaced atomically.
+bool MappedImage::write_progress () const
+{
+  std::string tmp_name = progress_name + ".tmp";
+  {
+    std::ofstream os (tmp_name.c_str ());
+    os << rows_done << std::endl;
+    if (!os)
+      return false;
+  }
+
+  return std::rename (tmp_name.c_str (), progress_name.c_str ()) == 0;
+}
+
+bool MappedImage::set_rows_done (int n)
+{
+  // msync needs a page-aligned address.
+  char *base = static_cast <char *> (mapping);
+  size_t header = image_data - (pixel *) base;
+  size_t first = header + (size_t) 3 * width * rows_done;
+  size_t last = header + (size_t) 3 * width * n;
+  first -= first % sysconf (_SC_PAGESIZE);
+  if (msync (base + first, last - first, MS_SYNC) == -1)
+    return false;
+
+  rows_done = n;
+  if (rows_done < height)
+    return write_progress ();
+
+  // Make sure the header is on disk too before dropping the progress file.
+  return msync (base, mapping_size, MS_SYNC) == 0
+	 && std::remove (progress_name.c_str ()) == 0;
+}
+
+#else
+// Without mmap there is no out-of-core image.
+bool MappedImage::open (const char *file_name, int w, int h, bool resume)
+{
+  return false;
+}
+
+void MappedImage::close ()
+{
+}
+
+bool MappedImage::write_progress () const
+{
+  return false;
+}
+
+bool MappedImage::set_rows_done (int n)
+{
+  return false;
+}
+#endif
@@ -6,10 +6,57 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
 #include "v3d.h"
+#include "pngwrite.h"
 
 enum image_file_format { OUT_PPM, OUT_PNG };
 
+// Where an image lies within a larger frame, for images that hold only
+// a part of it.  The region is stored in the image file (as a comment
+// in PPM files and as a text chunk in PNG files) so that the parts can
+// be put back together later.
+struct ImageRegion {
+  int x, y;
+  int full_width, full_height;	// zero if the image is not a region
+
+  ImageRegion () : x (0), y (0), full_width (0), full_height (0) {}
+  ImageRegion (int x_, int y_, int full_width_, int full_height_) :
+    x (x_), y (y_), full_width (full_width_), full_height (full_height_) {}
+
+  bool empty () const { return full_width == 0; }
+
+  // Convert to and from the text stored in the file, "X Y WIDTH HEIGHT".
+  // parse returns false if S is not valid.
+  std::string to_string () const;
+  bool parse (const std::string &s);
+};
+
+// Writes an image to a stream one or more rows at a time, from top
+// to bottom.  Each method returns false if there was an error.
+class ImageWriter {
+  std::ostream &os;
+  enum image_file_format fmt;
+  PngOptions png_options;
+  PngWriter png;
+  ImageRegion region;
+  int width;
+  bool ok;
+
+ public:
+  ImageWriter (std::ostream &os_, enum image_file_format fmt_,
+	       const PngOptions &png_options_ = PngOptions (),
+	       const ImageRegion &region_ = ImageRegion ()) :
+    os (os_), fmt (fmt_), png_options (png_options_), region (region_),
+    width (0), ok (true) {}
+
+  bool begin (int width, int height);
+
+  // Write the next N rows, stored one after another in DATA.
+  bool write_rows (const unsigned char *data, int n);
+  bool end ();
+};
+
 class Image
   {
   protected:
@@ -26,10 +73,23 @@ class Image
 	  delete[] image_data;
       };
 
-    bool write(std::ostream &os, enum image_file_format fmt) const;
-    bool write(const char *file_name, enum image_file_format fmt) const {
+    bool write(std::ostream &os, enum image_file_format fmt,
+	       const PngOptions &png_options = PngOptions (),
+	       const ImageRegion &region = ImageRegion ()) const;
+    bool write(const char *file_name, enum image_file_format fmt,
+	       const PngOptions &png_options = PngOptions (),
+	       const ImageRegion &region = ImageRegion ()) const {
       std::ofstream os (file_name, std::ofstream::binary);
-      return write (os, fmt);
+      return write (os, fmt, png_options, region);
+    }
+
+    // Read a binary PPM or a PNG file, and store in REGION the part of
+    // the frame it holds, if it says so.  Return false if there was an
+    // error.
+    bool read (std::istream &is, ImageRegion &region);
+    bool read (const char *file_name, ImageRegion &region) {
+      std::ifstream is (file_name, std::ifstream::binary);
+      return is && read (is, region);
     }
 
     const pixel *get_image_data () const { return image_data; }
@@ -38,17 +98,54 @@ class Image
     int get_height () const { return height; }
 
     void set_size (int w, int h) {
+      if (image_data)
+	delete[] image_data;
       width = w;
       height = h;
-      image_data = new unsigned char[3 * w * h];
+      image_data = new unsigned char[(size_t) 3 * w * h];
     }
 
     void set_pixel (int x, int y, const Color &c) {
-      unsigned char *p = image_data + 3 * (width * y + x);
+      unsigned char *p = image_data + (size_t) 3 * ((size_t) width * y + x);
       p[0] = c.r < 0 ? 0 : (unsigned char) (c.r * 255);
       p[1] = c.g < 0 ? 0 : (unsigned char) (c.g * 255);
       p[2] = c.b < 0 ? 0 : (unsigned char) (c.b * 255);
     }
   };
 
+// An image whose pixels live in a binary PPM file mapped in memory, so
+// that it can be larger than the available memory and the pixels reach
+// the disk without a final copy.  The number of rows completed so far is
+// kept in FILE_NAME.progress, which is removed when the image is done;
+// this makes it possible to resume an interrupted render.  set_size must
+// not be called on a MappedImage.
+class MappedImage : public Image
+  {
+    void *mapping;
+    size_t mapping_size;
+    std::string progress_name;
+    int rows_done;
+
+    MappedImage (const MappedImage &);
+    MappedImage &operator = (const MappedImage &);
+
+    bool write_progress () const;
+
+  public:
+    MappedImage () : mapping (NULL), mapping_size (0), rows_done (0) {}
+    ~MappedImage () { close (); }
+
+    // Map FILE_NAME as a W x H image.  If RESUME is true and the file
+    // already holds an image of that size, keep its pixels and the
+    // progress made so far; otherwise create the file from scratch.
+    // Return false if the file cannot be created or mapped.
+    bool open (const char *file_name, int w, int h, bool resume);
+    void close ();
+
+    int get_rows_done () const { return rows_done; }
+
+    // Flush rows up to N - 1 to disk, then record them as completed.
+    bool set_rows_done (int n);
+  };
+
 #endif
@@ -0,0 +1,226 @@
+// Example ray tracing program
+// Instances of an entity placed with an affine transform
+
+#include "config.h"
+#include "instance.h"
+
+#include <cmath>
+
+Transform::Transform ()
+{
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 4; c++)
+      m[r][c] = r == c;
+}
+
+Transform Transform::translate (const Vector3D &v)
+{
+  Transform t;
+  t.m[0][3] = v.x, t.m[1][3] = v.y, t.m[2][3] = v.z;
+  return t;
+}
+
+Transform Transform::scale (real x, real y, real z)
+{
+  Transform t;
+  t.m[0][0] = x, t.m[1][1] = y, t.m[2][2] = z;
+  return t;
+}
+
+// Return a rotation that turns axis A towards axis B by DEGREES.
+static Transform rotation (int a, int b, real degrees)
+{
+  real angle = degrees * M_PI / 180;
+  real c = cos (angle), s = sin (angle);
+  Transform t;
+  t.m[a][a] = c, t.m[a][b] = -s;
+  t.m[b][a] = s, t.m[b][b] = c;
+  return t;
+}
+
+Transform Transform::rotate_x (real degrees)
+{
+  return rotation (1, 2, degrees);
+}
+
+Transform Transform::rotate_y (real degrees)
+{
+  return rotation (2, 0, degrees);
+}
+
+Transform Transform::rotate_z (real degrees)
+{
+  return rotation (0, 1, degrees);
+}
+
+Transform Transform::operator * (const Transform &t) const
+{
+  Transform result;
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 4; c++)
+      result.m[r][c] = m[r][0] * t.m[0][c] + m[r][1] * t.m[1][c]
+		       + m[r][2] * t.m[2][c] + (c == 3 ? m[r][3] : 0);
+  return result;
+}
+
+real Transform::det () const
+{
+  return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+	 - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+	 + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+// The inverse of the linear part is its adjugate divided by the
+// determinant; the translation is then undone in the new space.
+Transform Transform::inverse () const
+{
+  Transform t;
+  real d = 1 / det ();
+  for (int r = 0; r < 3; r++)
+    {
+      int r1 = (r + 1) % 3, r2 = (r + 2) % 3;
+      for (int c = 0; c < 3; c++)
+	{
+	  int c1 = (c + 1) % 3, c2 = (c + 2) % 3;
+	  t.m[c][r] = (m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) * d;
+	}
+    }
+
+  Vector3D v = t.vector (Vector3D (m[0][3], m[1][3], m[2][3]));
+  t.m[0][3] = -v.x, t.m[1][3] = -v.y, t.m[2][3] = -v.z;
+  return t;
+}
+
+// Return R in the space of the instanced entity, with its direction
+// normalized, and store in SCALE the factor that converts distances
+// along R to distances along the result.
+Intersection Instance::local_ray (const NormRay3D &r, real &scale) const
+{
+  Vector3D dir = to_object.vector (r.dir);
+  scale = dir.length ();
+  return Intersection (to_object (r.source), dir);
+}
+
+bool Instance::inside (const Point3D &p) const
+{
+  return obj.inside (to_object (p));
+}
+
+bool Instance::intersect (Intersection &i, const Object &o, real tlim) const
+{
+  real scale;
+  Intersection local = local_ray (i.r, scale);
+  local.t = i.t * scale;
+  if (!obj.intersect (local, o, tlim * scale))
+    return false;
+
+  i.t = local.t / scale;
+  i.entity = this;
+  i.object = &o;
+  i.from_inside = local.from_inside;
+  i.prim = local.prim;
+  i.bu = local.bu;
+  i.bv = local.bv;
+  i.part = local.entity;
+  return true;
+}
+
+bool Instance::occludes (const NormRay3D &r, const Object &o,
+			 real tmax) const
+{
+  real scale;
+  Intersection local = local_ray (r, scale);
+  return obj.occludes (local.r, o, tmax * scale);
+}
+
+// Store in LOCAL the hit of the instanced entity that I refers to.  If
+// I did not come from intersect, but was made by an instance that
+// contains this one, only the part of the outer instance was recorded;
+// the hit is then found again, looking just around its distance so
+// that the same surface is found even after rounding.
+bool Instance::local_hit (const Intersection &i, Intersection &local) const
+{
+  real scale;
+  local = local_ray (i.r, scale);
+  local.object = i.object;
+  local.from_inside = i.from_inside;
+  if (i.part)
+    {
+      local.t = i.t * scale;
+      local.entity = i.part;
+      local.prim = i.prim;
+      local.bu = i.bu;
+      local.bv = i.bv;
+      return true;
+    }
+
+  local.t = i.t * scale * (1 + 1e-4);
+  return obj.intersect (local, *i.object, i.t * scale * (1 - 1e-4));
+}
+
+real Instance::texture_u (const Point3D &p) const
+{
+  return obj.texture_u (to_object (p));
+}
+
+real Instance::texture_v (const Point3D &p) const
+{
+  return obj.texture_v (to_object (p));
+}
+
+real Instance::texture_u (const Intersection &i) const
+{
+  Intersection local (i.r);
+  if (!local_hit (i, local))
+    return texture_u (i.r (i.t));
+  return local.entity->texture_u (local);
+}
+
+real Instance::texture_v (const Intersection &i) const
+{
+  Intersection local (i.r);
+  if (!local_hit (i, local))
+    return texture_v (i.r (i.t));
+  return local.entity->texture_v (local);
+}
+
+// Normals are transformed by the inverse transpose of the transform.
+UnitVector3D Instance::get_normal (const Point3D &p) const
+{
+  Vector3D n = obj.get_normal (to_object (p));
+  return to_object.transposed_vector (n).normalize ();
+}
+
+UnitVector3D Instance::get_normal (const Intersection &i) const
+{
+  Intersection local (i.r);
+  if (!local_hit (i, local))
+    return -i.r.dir;
+
+  Vector3D n = local.entity->get_normal (local);
+  return to_object.transposed_vector (n).normalize ();
+}
+
+// Return a box containing B after it is transformed by T.
+static Bounds transform_bounds (const Transform &t, const Bounds &b)
+{
+  if (b.is_empty () || !b.is_finite ())
+    return b.is_empty () ? b : Bounds::infinite ();
+
+  Bounds result;
+  for (int k = 0; k < 8; k++)
+    result |= t (Point3D (k & 1 ? b.hi.x : b.lo.x,
+			  k & 2 ? b.hi.y : b.lo.y,
+			  k & 4 ? b.hi.z : b.lo.z));
+  return result;
+}
+
+Bounds Instance::get_bounds () const
+{
+  return transform_bounds (to_world, obj.get_bounds ());
+}
+
+Bounds Instance::get_surface_bounds () const
+{
+  return transform_bounds (to_world, obj.get_surface_bounds ());
+}
@@ -0,0 +1,83 @@
+// Example ray tracing program
+// Instances of an entity placed with an affine transform
+
+#ifndef PTGEN_INSTANCE_H
+#define PTGEN_INSTANCE_H
+
+#include "config.h"
+#include "v3d.h"
+#include "geom.h"
+
+// An affine transform, stored as the first three rows of a 4x4 matrix.
+// Transforms are composed like matrices: (a * b) (p) is a (b (p)).
+struct Transform {
+  real m[3][4];
+
+  // The identity.
+  Transform ();
+
+  static Transform translate (const Vector3D &v);
+  static Transform scale (real x, real y, real z);
+  static Transform rotate_x (real degrees);
+  static Transform rotate_y (real degrees);
+  static Transform rotate_z (real degrees);
+
+  Transform operator * (const Transform &t) const;
+
+  // Return the determinant of the linear part, which is zero if the
+  // transform cannot be inverted.
+  real det () const;
+  Transform inverse () const;
+
+  Point3D operator () (const Point3D &p) const {
+    return Point3D (m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+		    m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+		    m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+  }
+
+  // Apply the linear part to V, or its transpose.
+  Vector3D vector (const Vector3D &v) const {
+    return Vector3D (m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+		     m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+		     m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+  }
+  Vector3D transposed_vector (const Vector3D &v) const {
+    return Vector3D (m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+		     m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+		     m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+  }
+};
+
+// OBJ placed in the scene with a transform, which must be invertible.
+// OBJ is not copied, so any number of instances can share it, and each
+// costs only a few dozen bytes.  Rays are transformed into the space of
+// OBJ, and normals back into world space.
+//
+// Hits record the entity hit in the space of OBJ as their part, so
+// that its normal and texture coordinates can be found without
+// intersecting OBJ again.
+class Instance : public Entity {
+  const Entity &obj;
+  Transform to_world, to_object;
+
+  Intersection local_ray (const NormRay3D &r, real &scale) const;
+  bool local_hit (const Intersection &i, Intersection &local) const;
+
+ public:
+  Instance (const Entity &obj_, const Transform &t) :
+    obj (obj_), to_world (t), to_object (t.inverse ()) {}
+
+  bool inside (const Point3D &p) const;
+  bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
+  real texture_u (const Point3D &p) const;
+  real texture_v (const Point3D &p) const;
+  real texture_u (const Intersection &i) const;
+  real texture_v (const Intersection &i) const;
+  UnitVector3D get_normal (const Point3D &p) const;
+  UnitVector3D get_normal (const Intersection &i) const;
+  Bounds get_bounds () const;
+  Bounds get_surface_bounds () const;
+};
+
+#endif
@@ -3,10 +3,17 @@
 
 #include "light.h"
 
+#include <typeinfo>
+
 AbstractLight::~AbstractLight ()
 {
 }
 
+light_kind get_light_kind (const AbstractLight &l)
+{
+  return typeid (l) == typeid (Light) ? LIGHT_POINT : LIGHT_OTHER;
+}
+
 Color Light::get_color (const Point3D &p) const
 {
   return color;
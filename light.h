@@ -35,6 +35,12 @@ struct Light : AbstractLight {
   const Point3D &get_pos () const;
 };
 
+// Lights whose exact type is known to the tracer, which then reads
+// their position and color directly instead of going through the vtable.
+enum light_kind { LIGHT_OTHER, LIGHT_POINT };
+
+light_kind get_light_kind (const AbstractLight &l);
+
 struct LightWrapper : AbstractLight {
   const AbstractLight &l;
 
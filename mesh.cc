@@ -0,0 +1,429 @@
+// Example ray tracing program
+// Triangle meshes
+
+#include "config.h"
+#include "mesh.h"
+#include "stats.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+template <typename T> static inline real coord (const T &p, int axis)
+{
+  return axis == 0 ? p.x : axis == 1 ? p.y : p.z;
+}
+
+// What the watertight intersection test of Woop, Benthin and Wald needs
+// to know about a ray: its direction is mapped to the Z axis by swapping
+// the axes so that Z is the largest component of the direction, and by
+// shearing X and Y.  The triangles are then projected along Z and tested
+// in two dimensions, so that rays through a shared edge or vertex always
+// hit at least one of the triangles around it.
+struct TriangleMesh::RayData {
+  Point3D org;
+  int kx, ky, kz;
+  real sx, sy, sz;
+
+  explicit RayData (const NormRay3D &r) : org (r.source) {
+    real ax = std::fabs (r.dir.x), ay = std::fabs (r.dir.y);
+    real az = std::fabs (r.dir.z);
+    kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    kx = kz == 2 ? 0 : kz + 1;
+    ky = kx == 2 ? 0 : kx + 1;
+
+    // Keep the winding of the triangles.
+    real dz = coord (r.dir, kz);
+    if (dz < 0)
+      std::swap (kx, ky);
+
+    sx = coord (r.dir, kx) / dz;
+    sy = coord (r.dir, ky) / dz;
+    sz = 1 / dz;
+  }
+};
+
+// Test whether the ray described by RD hits triangle TRI at a distance
+// between TMIN and TMAX, excluded, and if so store the distance in T and
+// the weights of the second and third vertex in B1 and B2.  Both sides
+// of the triangle are hit.
+inline bool
+TriangleMesh::hit_triangle (const RayData &rd, int tri, real tmin, real tmax,
+			    real &t, real &b1, real &b2) const
+{
+  STATS_TEST (STATS_TRIANGLE);
+  const int *v = &vertex_index[3 * tri];
+  Vector3D a = vertices[v[0]] - rd.org;
+  Vector3D b = vertices[v[1]] - rd.org;
+  Vector3D c = vertices[v[2]] - rd.org;
+
+  real az = coord (a, rd.kz), bz = coord (b, rd.kz), cz = coord (c, rd.kz);
+  real ax = coord (a, rd.kx) - rd.sx * az, ay = coord (a, rd.ky) - rd.sy * az;
+  real bx = coord (b, rd.kx) - rd.sx * bz, by = coord (b, rd.ky) - rd.sy * bz;
+  real cx = coord (c, rd.kx) - rd.sx * cz, cy = coord (c, rd.ky) - rd.sy * cz;
+
+  // The scaled barycentric coordinates are the signed areas of the
+  // triangles formed by the origin with each edge.  When one is zero,
+  // the ray passes through an edge and the sign must be computed
+  // exactly, which double precision does for the products of floats.
+  real u = cx * by - cy * bx;
+  real w = bx * ay - by * ax;
+  real vv = ax * cy - ay * cx;
+  if (u == 0 || vv == 0 || w == 0)
+    {
+      u = (double) cx * by - (double) cy * bx;
+      vv = (double) ax * cy - (double) ay * cx;
+      w = (double) bx * ay - (double) by * ax;
+    }
+
+  if ((u < 0 || vv < 0 || w < 0) && (u > 0 || vv > 0 || w > 0))
+    return false;
+
+  real det = u + vv + w;
+  if (det == 0)
+    return false;
+
+  az *= rd.sz, bz *= rd.sz, cz *= rd.sz;
+  real dist = (u * az + vv * bz + w * cz) / det;
+  if (!(dist > tmin && dist < tmax))
+    return false;
+
+  STATS_HIT (STATS_TRIANGLE);
+  t = dist;
+  b1 = vv / det;
+  b2 = w / det;
+  return true;
+}
+
+// Leaf visitors for BVH::traverse.
+struct TriangleMesh::ClosestHit {
+  const TriangleMesh &mesh;
+  RayData rd;
+  real tmin, t, b1, b2;
+  int tri;
+
+  ClosestHit (const TriangleMesh &mesh_, const NormRay3D &r, real tmin_,
+	      real tmax) :
+    mesh (mesh_), rd (r), tmin (tmin_), t (tmax), b1 (0), b2 (0), tri (-1) {}
+
+  real limit () const { return t; }
+  bool operator () (const int *prims, int n) {
+    bool had_intersection = false;
+    for (int k = 0; k < n; k++)
+      if (mesh.hit_triangle (rd, prims[k], tmin, t, t, b1, b2))
+	{
+	  tri = prims[k];
+	  had_intersection = true;
+	}
+
+    return had_intersection;
+  }
+};
+
+struct TriangleMesh::AnyHit {
+  const TriangleMesh &mesh;
+  RayData rd;
+  real tmax;
+
+  AnyHit (const TriangleMesh &mesh_, const NormRay3D &r, real tmax_) :
+    mesh (mesh_), rd (r), tmax (tmax_) {}
+
+  real limit () const { return tmax; }
+  bool operator () (const int *prims, int n) {
+    real t, b1, b2;
+    for (int k = 0; k < n; k++)
+      if (mesh.hit_triangle (rd, prims[k], 0, tmax, t, b1, b2))
+	return true;
+
+    return false;
+  }
+};
+
+struct TriangleMesh::CountHits {
+  const TriangleMesh &mesh;
+  RayData rd;
+  int count;
+
+  CountHits (const TriangleMesh &mesh_, const NormRay3D &r) :
+    mesh (mesh_), rd (r), count (0) {}
+
+  real limit () const { return Bounds::huge; }
+  bool operator () (const int *prims, int n) {
+    real t, b1, b2;
+    for (int k = 0; k < n; k++)
+      count += mesh.hit_triangle (rd, prims[k], 0, Bounds::huge, t, b1, b2);
+
+    return false;
+  }
+};
+
+void TriangleMesh::add_triangle (const int *v, const int *n, const int *uv)
+{
+  // The indices of normals and texture coordinates are only stored
+  // once a triangle has them.
+  if (n && normal_index.empty ())
+    normal_index.assign (vertex_index.size (), -1);
+  if (uv && uv_index.empty ())
+    uv_index.assign (vertex_index.size (), -1);
+
+  for (int k = 0; k < 3; k++)
+    {
+      vertex_index.push_back (v[k]);
+      if (!normal_index.empty ())
+	normal_index.push_back (n ? n[k] : -1);
+      if (!uv_index.empty ())
+	uv_index.push_back (uv ? uv[k] : -1);
+    }
+}
+
+void TriangleMesh::build ()
+{
+  std::vector<Bounds> boxes (n_triangles ());
+  for (int k = 0; k < n_triangles (); k++)
+    for (int j = 0; j < 3; j++)
+      boxes[k] |= vertices[vertex_index[3 * k + j]];
+
+  bvh.build (boxes, 4);
+}
+
+Vector3D TriangleMesh::face_normal (int tri) const
+{
+  const int *v = &vertex_index[3 * tri];
+  return (vertices[v[1]] - vertices[v[0]]) ^ (vertices[v[2]] - vertices[v[0]]);
+}
+
+// A point is inside the mesh if a ray from it crosses the surface an
+// odd number of times.  The direction of the ray is chosen so that it
+// is unlikely to be parallel to the triangles of regular meshes.
+bool TriangleMesh::inside (const Point3D &p) const
+{
+  if (!get_bounds ().contains (p))
+    return false;
+
+  NormRay3D r (p, Vector3D (1, 0.0123, 0.0457).normalize ());
+  CountHits hits (*this, r);
+  bvh.traverse (r, hits);
+  return hits.count & 1;
+}
+
+bool TriangleMesh::intersect (Intersection &i, const Object &o,
+			      real tlim) const
+{
+  ClosestHit hit (*this, i.r, tlim, i.t);
+  if (!bvh.traverse (i.r, hit))
+    return false;
+
+  i.t = hit.t;
+  i.entity = this;
+  i.object = &o;
+  i.from_inside = i.r.dir * face_normal (hit.tri) > 0;
+  i.prim = hit.tri;
+  i.bu = hit.b1;
+  i.bv = hit.b2;
+  return true;
+}
+
+bool TriangleMesh::occludes (const NormRay3D &r, const Object &o,
+			     real tmax) const
+{
+  AnyHit hit (*this, r, tmax);
+  return bvh.traverse (r, hit, true);
+}
+
+real TriangleMesh::texture_u (const Intersection &i) const
+{
+  if (i.prim == -1 || uv_index.empty () || uv_index[3 * i.prim] == -1)
+    return texture_u (i.r (i.t));
+
+  const int *uv = &uv_index[3 * i.prim];
+  return (1 - i.bu - i.bv) * uvs[2 * uv[0]] + i.bu * uvs[2 * uv[1]]
+	 + i.bv * uvs[2 * uv[2]];
+}
+
+real TriangleMesh::texture_v (const Intersection &i) const
+{
+  if (i.prim == -1 || uv_index.empty () || uv_index[3 * i.prim] == -1)
+    return texture_v (i.r (i.t));
+
+  const int *uv = &uv_index[3 * i.prim];
+  return (1 - i.bu - i.bv) * uvs[2 * uv[0] + 1] + i.bu * uvs[2 * uv[1] + 1]
+	 + i.bv * uvs[2 * uv[2] + 1];
+}
+
+// The normal of a point cannot be found without knowing the triangle.
+UnitVector3D TriangleMesh::get_normal (const Point3D &p) const
+{
+  std::abort ();
+}
+
+// The interpolated normal is made to point to the same side as the
+// normal of the triangle, which decides whether the hit is from inside.
+UnitVector3D TriangleMesh::get_normal (const Intersection &i) const
+{
+  Vector3D face = face_normal (i.prim);
+  if (normal_index.empty () || normal_index[3 * i.prim] == -1)
+    return face.normalize ();
+
+  const int *n = &normal_index[3 * i.prim];
+  Vector3D normal = normals[n[0]] * (1 - i.bu - i.bv) + normals[n[1]] * i.bu
+		    + normals[n[2]] * i.bv;
+  if (normal * face < 0)
+    normal = -normal;
+  return normal.normalize ();
+}
+
+Bounds TriangleMesh::get_bounds () const
+{
+  return bvh.node_count ? bvh.node_data[0].bounds : Bounds ();
+}
+
+// Read COUNT numbers from P into X, and return false if there are not
+// enough.  P is left after the last one.
+static bool
+parse_numbers (const char *&p, real *x, int count)
+{
+  for (int k = 0; k < count; k++)
+    {
+      char *end;
+      x[k] = std::strtod (p, &end);
+      if (end == p)
+	return false;
+      p = end;
+    }
+
+  return true;
+}
+
+// Parse the vertex of a face statement at P, of the form V, V/T, V//N or
+// V/T/N, and store its indices, counted from zero, in V, T and N; the
+// last two are -1 if missing.  COUNTS gives the number of vertices,
+// texture coordinates and normals read so far, which are used to check
+// the indices and to resolve negative ones.  P is left after the vertex.
+static bool
+parse_face_vertex (const char *&p, const int *counts, int &v, int &t, int &n)
+{
+  int index[3] = { 0, 0, 0 };
+  for (int k = 0; k < 3; k++)
+    {
+      if (*p != '/')
+	{
+	  char *end;
+	  long x = std::strtol (p, &end, 10);
+	  if (end == p || x == 0)
+	    return false;
+
+	  index[k] = x < 0 ? counts[k] + x + 1 : x;
+	  if (index[k] < 1 || index[k] > counts[k])
+	    return false;
+	  p = end;
+	}
+      else if (k == 0)
+	return false;
+
+      if (*p != '/')
+	break;
+      p++;
+    }
+
+  if (*p != '\0' && !std::isspace ((unsigned char) *p))
+    return false;
+
+  v = index[0] - 1, t = index[1] - 1, n = index[2] - 1;
+  return true;
+}
+
+static inline const char *
+skip_blanks (const char *p)
+{
+  while (*p != '\0' && std::isspace ((unsigned char) *p))
+    p++;
+  return p;
+}
+
+bool read_obj (std::istream &is, TriangleMesh &mesh, std::string &error)
+{
+  std::string line;
+  std::vector<int> v, t, n;
+  for (int line_number = 1; std::getline (is, line); line_number++)
+    {
+      const char *p = skip_blanks (line.c_str ());
+      const char *cmd = p;
+      while (*p != '\0' && !std::isspace ((unsigned char) *p))
+	p++;
+      std::string word (cmd, p - cmd);
+
+      const char *msg = NULL;
+      real x[3];
+      if (word == "v")
+	{
+	  if (!parse_numbers (p, x, 3))
+	    msg = "expected three coordinates";
+	  else
+	    mesh.add_vertex (Point3D (x[0], x[1], x[2]));
+	}
+      else if (word == "vn")
+	{
+	  if (!parse_numbers (p, x, 3))
+	    msg = "expected three coordinates";
+	  else
+	    mesh.add_normal (Vector3D (x[0], x[1], x[2]));
+	}
+      else if (word == "vt")
+	{
+	  if (!parse_numbers (p, x, 2))
+	    msg = "expected two coordinates";
+	  else
+	    mesh.add_uv (x[0], x[1]);
+	}
+      else if (word == "f")
+	{
+	  int counts[3] = { mesh.n_vertices (), mesh.n_uvs (),
+			    mesh.n_normals () };
+	  bool have_t = true, have_n = true;
+	  v.clear (), t.clear (), n.clear ();
+	  while (*(p = skip_blanks (p)) != '\0')
+	    {
+	      int vk, tk, nk;
+	      if (!parse_face_vertex (p, counts, vk, tk, nk))
+		{
+		  msg = "invalid vertex";
+		  break;
+		}
+	      v.push_back (vk), t.push_back (tk), n.push_back (nk);
+	      have_t &= tk != -1;
+	      have_n &= nk != -1;
+	    }
+
+	  if (!msg && v.size () < 3)
+	    msg = "a face needs at least three vertices";
+
+	  // Split the polygon into a fan of triangles.
+	  if (!msg)
+	    for (size_t k = 1; k + 1 < v.size (); k++)
+	      {
+		int vi[3] = { v[0], v[k], v[k + 1] };
+		int ti[3] = { t[0], t[k], t[k + 1] };
+		int ni[3] = { n[0], n[k], n[k + 1] };
+		mesh.add_triangle (vi, have_n ? ni : NULL, have_t ? ti : NULL);
+	      }
+	}
+
+      if (msg)
+	{
+	  std::ostringstream os;
+	  os << line_number << ": " << msg;
+	  error = os.str ();
+	  return false;
+	}
+    }
+
+  if (is.bad ())
+    {
+      error = "read error";
+      return false;
+    }
+
+  return true;
+}
@@ -0,0 +1,87 @@
+// Example ray tracing program
+// Triangle meshes
+
+#ifndef PTGEN_MESH_H
+#define PTGEN_MESH_H
+
+#include "config.h"
+#include "v3d.h"
+#include "geom.h"
+#include "bvh.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A mesh of triangles that share their vertices, normals and texture
+// coordinates, which are stored once and referred to by index.  The
+// triangles are found through a BVH of their own, so that a single
+// object can hold millions of them.  Rays hit both sides of the
+// triangles; they hit them from inside if they come from the side
+// opposite to the one given by the order of the vertices (counter-
+// clockwise when seen from outside).
+//
+// Normals and texture coordinates are interpolated across each
+// triangle if it has them; otherwise the normal of the triangle is
+// used, and the texture coordinates are X and Z.
+class TriangleMesh : public Entity {
+  std::vector<Point3D> vertices;
+  std::vector<Vector3D> normals;
+  std::vector<real> uvs;		// two per texture coordinate
+
+  // Three indices per triangle.  NORMAL_INDEX and UV_INDEX are empty
+  // if no triangle has normals or texture coordinates, and otherwise
+  // hold -1 for the triangles that have none.
+  std::vector<int> vertex_index, normal_index, uv_index;
+
+  BVH bvh;
+
+  struct RayData;
+  struct ClosestHit;
+  struct AnyHit;
+  struct CountHits;
+
+  bool hit_triangle (const RayData &rd, int tri, real tmin, real tmax,
+		     real &t, real &b1, real &b2) const;
+  Vector3D face_normal (int tri) const;
+
+ public:
+  int n_vertices () const { return vertices.size (); }
+  int n_normals () const { return normals.size (); }
+  int n_uvs () const { return uvs.size () / 2; }
+  int n_triangles () const { return vertex_index.size () / 3; }
+
+  void add_vertex (const Point3D &p) { vertices.push_back (p); }
+  void add_normal (const Vector3D &n) { normals.push_back (n); }
+  void add_uv (real u, real v) { uvs.push_back (u); uvs.push_back (v); }
+
+  // Add a triangle with the vertices V[0] to V[2], and optionally the
+  // normals N[0] to N[2] and texture coordinates UV[0] to UV[2]; all
+  // of these are indices of elements added before.
+  void add_triangle (const int *v, const int *n = NULL, const int *uv = NULL);
+
+  // Build the BVH of the triangles.  This must be done after the last
+  // triangle is added and before the mesh is rendered.
+  void build ();
+
+  bool inside (const Point3D &p) const;
+  bool intersect (Intersection &i, const Object &o, real tlim = 0.0) const;
+  bool occludes (const NormRay3D &r, const Object &o, real tmax) const;
+  real texture_u (const Point3D &p) const { return p.x; }
+  real texture_v (const Point3D &p) const { return p.z; }
+  real texture_u (const Intersection &i) const;
+  real texture_v (const Intersection &i) const;
+  UnitVector3D get_normal (const Point3D &p) const;
+  UnitVector3D get_normal (const Intersection &i) const;
+  Bounds get_bounds () const;
+};
+
+// Add to MESH the vertices, normals, texture coordinates and faces of
+// the Wavefront OBJ file read from IS, one line at a time.  Faces with
+// more than three vertices are split into triangles around their first
+// vertex, and the other statements are ignored.  build () is not
+// called.  Return false and store in ERROR a message, preceded by the
+// number of the line, if there is an error.
+bool read_obj (std::istream &is, TriangleMesh &mesh, std::string &error);
+
+#endif
@@ -0,0 +1,75 @@
+// Example ray tracing program
+// Packets of rays traced together
+
+#ifndef PTGEN_PACKET_H
+#define PTGEN_PACKET_H
+
+#include "config.h"
+#include "v3d.h"
+
+#ifndef PACKET_SIZE
+#define PACKET_SIZE 8
+#endif
+
+class Entity;
+class Object;
+
+// A set of bits, one per ray in a packet.
+typedef unsigned int PacketMask;
+
+// PACKET_SIZE rays, stored as a structure of arrays so that the loops
+// over the rays can be vectorized.  Like Intersection, a packet also
+// holds the closest hit found so far for each ray.
+struct RayPacket {
+  enum { size = PACKET_SIZE };
+
+  real ox[size], oy[size], oz[size];
+  real dx[size], dy[size], dz[size];
+
+  real t[size];
+  const Entity *entity[size];
+  const Object *object[size];
+  bool from_inside[size];
+  unsigned char kind[size];
+  int prim[size];
+  real bu[size], bv[size];
+  const Entity *part[size];
+
+  static PacketMask all () { return (PacketMask) ((1UL << size) - 1); }
+
+  // Store R (after normalizing it) as ray number K and forget any hit.
+  void set_ray (int k, const Ray3D &r);
+  NormRay3D get_ray (int k) const {
+    return NormRay3D (Point3D (ox[k], oy[k], oz[k]),
+		      UnitVector3D (dx[k], dy[k], dz[k]));
+  }
+
+  // Record a hit for ray number K.  The kind of the entity (see
+  // Intersection) is reset to ENTITY_OTHER, i.e. zero.
+  void set_hit (int k, real t_, const Entity *e, const Object *o,
+		bool from_inside_ = false) {
+    t[k] = t_;
+    entity[k] = e;
+    object[k] = o;
+    from_inside[k] = from_inside_;
+    kind[k] = 0;
+  }
+
+  // Record the primitive hit by ray number K (see Intersection).
+  void set_prim (int k, int prim_, real bu_, real bv_,
+		 const Entity *part_ = NULL) {
+    prim[k] = prim_;
+    bu[k] = bu_;
+    bv[k] = bv_;
+    part[k] = part_;
+  }
+
+  // Set to KIND the kind of the entities hit by the rays in MASK.
+  void set_kind (PacketMask mask, int kind_) {
+    for (int k = 0; k < size; k++)
+      if (mask & (1U << k))
+	kind[k] = kind_;
+  }
+};
+
+#endif
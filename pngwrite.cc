@@ -4,12 +4,38 @@
 
 #include "config.h"
 #include "pngwrite.h"
+#include "thread.h"
+
+#include <cstdlib>
+#include <cstring>
+
+int parse_png_filter (const char *name)
+{
+  static const char *const names[] = {
+    "none", "sub", "up", "average", "paeth", NULL
+  };
+
+  if (std::strcmp (name, "adaptive") == 0)
+    return PngOptions::adaptive;
+
+  for (int k = 0; names[k]; k++)
+    if (std::strcmp (name, names[k]) == 0)
+      return k;
+
+  return -2;
+}
 
 #ifdef HAVE_LIBPNG
 #include <ctime>
 #include <cstdio>
+#include <algorithm>
+#include <vector>
 #include "png.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 // The png_jmpbuf() macro, used in error handling, became available in
 // libpng version 1.0.6.  If you want to be able to run your code with older
 // versions of libpng, you must define the macro yourself (but only if it
@@ -33,11 +59,379 @@ void user_flush_data(png_structp png_ptr)
 }
 
 
-// Scrive un file PNG utilizzando la libreria libpng.  Il codice
-// e' preso dalla documentazione della libreria.
+struct PngWriter::State {
+  png_structp png_ptr;	// NULL if the image is encoded in strips
+  png_infop info_ptr;
+
+  std::ostream *os;
+  PngOptions options;
+  size_t row_bytes;
+  int strip_rows;
+
+  // The last row written, and the last bytes that were given to
+  // deflate, which are the dictionary for the next strip.
+  std::vector<unsigned char> prev_row;
+  std::vector<unsigned char> window;
+  unsigned long adler;
+};
+
+// Free everything and fail.
+bool PngWriter::fail ()
+{
+  if (state->png_ptr)
+    png_destroy_write_struct (&state->png_ptr, &state->info_ptr);
+  delete state;
+  state = NULL;
+  return (false);
+}
+
+PngWriter::~PngWriter ()
+{
+  if (state)
+    fail ();
+}
+
+#ifdef HAVE_ZLIB
+// Strips are about this big, like pigz's blocks.  Deflate looks back
+// at most WINDOW_SIZE bytes, so that is all the dictionary it needs.
+static const size_t strip_bytes = 128 * 1024;
+static const size_t window_size = 32 * 1024;
+
+struct PngWriter::Strip {
+  const unsigned char *rows;
+  const unsigned char *prev;	// the row above the first one
+  int n_rows;
 
-bool write_png (std::ostream & os, const char *img, int width, int height)
+  std::vector<unsigned char> dict, filtered, out;
+  unsigned long adler;
+  bool ok;
+};
+
+// Fills the strips whose index modulo N_THREADS is INDEX.  In the first
+// phase the rows are filtered, in the second they are deflated.
+class PngWriter::StripThread : public Thread {
+  std::vector<Strip> &strips;
+  const State &state;
+  int index, n_threads, phase;
+
+  void filter (Strip &st);
+  void deflate (Strip &st);
+
+ public:
+  StripThread (std::vector<Strip> &strips_, const State &state_,
+	       int index_, int n_threads_, int phase_) :
+    strips (strips_), state (state_), index (index_),
+    n_threads (n_threads_), phase (phase_) {}
+
+  void run ();
+};
+
+static void put_be32 (unsigned char *p, unsigned long x)
 {
+  p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
+
+static void write_chunk (std::ostream &os, const char *type,
+			 const unsigned char *data, size_t len)
+{
+  unsigned char buf[4];
+  put_be32 (buf, len);
+  os.write (reinterpret_cast <const char *> (buf), 4);
+  os.write (type, 4);
+  os.write (reinterpret_cast <const char *> (data), len);
+
+  // crc32 returns zero for a null pointer, even with a zero length.
+  unsigned long crc = crc32 (0, reinterpret_cast <const Bytef *> (type), 4);
+  if (len)
+    crc = crc32 (crc, data, len);
+  put_be32 (buf, crc);
+  os.write (reinterpret_cast <const char *> (buf), 4);
+}
+
+// Append to W the bytes in DATA, keeping only the last WINDOW_SIZE.
+static void append_window (std::vector<unsigned char> &w,
+			   const std::vector<unsigned char> &data)
+{
+  size_t n = std::min (data.size (), window_size);
+  w.insert (w.end (), data.end () - n, data.end ());
+  if (w.size () > window_size)
+    w.erase (w.begin (), w.end () - window_size);
+}
+
+// The Paeth predictor, written without branches so that the loop
+// below can be vectorized.
+static inline int paeth (int a, int b, int c)
+{
+  int pa = std::abs (b - c);
+  int pb = std::abs (a - c);
+  int pc = std::abs (a + b - c - c);
+  int ab = pa <= pb ? a : b;
+  return (pa <= pb ? pa : pb) <= pc ? ab : c;
+}
+
+// Filter the N bytes of ROW, the row above which is PREV, with filter
+// TYPE and store the filter type followed by the result in OUT.  The
+// first pixel has no left neighbour, so it is done separately and each
+// filter gets its own loop.
+static void filter_row (int type, const unsigned char *row,
+			const unsigned char *prev, size_t n,
+			unsigned char *out)
+{
+  const size_t bpp = 3;
+  *out++ = type;
+  size_t k;
+  switch (type)
+    {
+    case 0:
+      std::memcpy (out, row, n);
+      break;
+
+    case 1:
+      std::memcpy (out, row, bpp);
+      for (k = bpp; k < n; k++)
+	out[k] = row[k] - row[k - bpp];
+      break;
+
+    case 2:
+      for (k = 0; k < n; k++)
+	out[k] = row[k] - prev[k];
+      break;
+
+    case 3:
+      for (k = 0; k < bpp; k++)
+	out[k] = row[k] - prev[k] / 2;
+      for (; k < n; k++)
+	out[k] = row[k] - (row[k - bpp] + prev[k]) / 2;
+      break;
+
+    default:
+      for (k = 0; k < bpp; k++)
+	out[k] = row[k] - prev[k];
+      for (; k < n; k++)
+	out[k] = row[k] - paeth (row[k - bpp], prev[k], prev[k - bpp]);
+      break;
+    }
+}
+
+// Return the sum of the absolute values of the N bytes at P, taken as
+// signed bytes, which is what libpng uses to pick a filter.
+static unsigned long filter_cost (const unsigned char *p, size_t n)
+{
+  unsigned long sum = 0;
+  for (size_t k = 0; k < n; k++)
+    sum += std::abs ((int) (signed char) p[k]);
+  return sum;
+}
+
+void PngWriter::StripThread::filter (Strip &st)
+{
+  size_t n = state.row_bytes;
+  int type = state.options.filter;
+  st.filtered.resize (st.n_rows * (n + 1));
+
+  std::vector<unsigned char> tmp;
+  if (type == PngOptions::adaptive)
+    tmp.resize (n + 1);
+
+  for (int y = 0; y < st.n_rows; y++)
+    {
+      const unsigned char *row = st.rows + y * n;
+      const unsigned char *prev = y == 0 ? st.prev : row - n;
+      unsigned char *out = &st.filtered[y * (n + 1)];
+      if (type != PngOptions::adaptive)
+	{
+	  filter_row (type, row, prev, n, out);
+	  continue;
+	}
+
+      // Try all filters, and keep the one with the smallest sum.
+      filter_row (0, row, prev, n, out);
+      unsigned long best = filter_cost (out + 1, n);
+      for (int t = 1; t < 5; t++)
+	{
+	  filter_row (t, row, prev, n, &tmp[0]);
+	  unsigned long sum = filter_cost (&tmp[1], n);
+	  if (sum < best)
+	    {
+	      best = sum;
+	      std::memcpy (out, &tmp[0], n + 1);
+	    }
+	}
+    }
+
+  st.adler = adler32 (adler32 (0, NULL, 0), &st.filtered[0],
+		      st.filtered.size ());
+}
+
+// Compress the strip as raw deflate data ending with a sync flush, i.e.
+// on a byte boundary, so that it can be followed by the next strip.
+void PngWriter::StripThread::deflate (Strip &st)
+{
+  z_stream z;
+  std::memset (&z, 0, sizeof (z));
+  int strategy = state.options.filter == 0 ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  st.ok = deflateInit2 (&z, state.options.level, Z_DEFLATED, -15, 8,
+			strategy) == Z_OK;
+  if (!st.ok)
+    return;
+
+  if (!st.dict.empty ())
+    deflateSetDictionary (&z, &st.dict[0], st.dict.size ());
+
+  z.next_in = &st.filtered[0];
+  z.avail_in = st.filtered.size ();
+  st.out.resize (deflateBound (&z, st.filtered.size ()) + 64);
+
+  size_t done = 0;
+  for (;;)
+    {
+      z.next_out = &st.out[done];
+      z.avail_out = st.out.size () - done;
+      int ret = ::deflate (&z, Z_SYNC_FLUSH);
+      done = st.out.size () - z.avail_out;
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+	{
+	  st.ok = false;
+	  break;
+	}
+
+      // The flush is complete if deflate did not fill the buffer.
+      if (z.avail_out != 0)
+	break;
+      st.out.resize (st.out.size () * 2);
+    }
+
+  st.out.resize (done);
+  deflateEnd (&z);
+}
+
+void PngWriter::StripThread::run ()
+{
+  for (size_t k = index; k < strips.size (); k += n_threads)
+    if (phase == 0)
+      filter (strips[k]);
+    else
+      deflate (strips[k]);
+}
+
+// Encode N rows in parallel and write them as IDAT chunks.
+bool PngWriter::write_strips (const char *rows, int n)
+{
+  State &s = *state;
+  const unsigned char *data = reinterpret_cast <const unsigned char *> (rows);
+  std::vector<Strip> strips ((n + s.strip_rows - 1) / s.strip_rows);
+  for (size_t k = 0; k < strips.size (); k++)
+    {
+      int first = k * s.strip_rows;
+      strips[k].rows = data + first * s.row_bytes;
+      strips[k].prev = first == 0 ? &s.prev_row[0]
+			: strips[k].rows - s.row_bytes;
+      strips[k].n_rows = std::min (s.strip_rows, n - first);
+      strips[k].ok = true;
+    }
+
+  int n_threads = std::min ((int) strips.size (), s.options.threads);
+  for (int phase = 0; phase < 2; phase++)
+    {
+      // Each strip's dictionary is the end of the data before it.
+      if (phase == 1)
+	for (size_t k = 0; k < strips.size (); k++)
+	  {
+	    strips[k].dict = k == 0 ? s.window : strips[k - 1].dict;
+	    if (k > 0)
+	      append_window (strips[k].dict, strips[k - 1].filtered);
+	  }
+
+      // The calling thread works too, so start one thread less.
+      std::vector<StripThread *> workers;
+      for (int k = 1; k < n_threads; k++)
+	{
+	  workers.push_back (new StripThread (strips, s, k, n_threads, phase));
+	  workers.back ()->start ();
+	}
+
+      StripThread self (strips, s, 0, n_threads, phase);
+      self.run ();
+      for (size_t k = 0; k < workers.size (); k++)
+	{
+	  workers[k]->join ();
+	  delete workers[k];
+	}
+    }
+
+  bool ok = true;
+  for (size_t k = 0; k < strips.size (); k++)
+    {
+      Strip &st = strips[k];
+      ok &= st.ok;
+      s.adler = adler32_combine (s.adler, st.adler, st.filtered.size ());
+      write_chunk (*s.os, "IDAT", &st.out[0], st.out.size ());
+    }
+
+  Strip &last = strips.back ();
+  s.window = last.dict;
+  append_window (s.window, last.filtered);
+  s.prev_row.assign (data + (n - 1) * s.row_bytes, data + n * s.row_bytes);
+  return ok && *s.os ? true : fail ();
+}
+#endif
+
+// The code is taken from the documentation of libpng.  libpng reports
+// errors by jumping back to the last setjmp, so each method sets its own
+// error handler, which frees everything.
+
+bool PngWriter::begin (std::ostream &os, int width, int height,
+		       const PngOptions &options, const char *region)
+{
+  state = new State;
+  state->png_ptr = NULL;
+  state->info_ptr = NULL;
+  state->os = &os;
+  state->options = options;
+  state->row_bytes = 3 * (size_t) width;
+  if (state->options.threads <= 0)
+    state->options.threads = num_processors ();
+
+#ifdef HAVE_ZLIB
+  if (state->options.threads > 1)
+    {
+      State &s = *state;
+      s.strip_rows = (strip_bytes + s.row_bytes - 1) / s.row_bytes;
+      s.prev_row.assign (s.row_bytes, 0);
+      s.adler = adler32 (0, NULL, 0);
+
+      os.write ("\211PNG\r\n\032\n", 8);
+
+      unsigned char ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0,
+				 8, 2, 0, 0, 0 };	// 8-bit RGB
+      put_be32 (ihdr, width);
+      put_be32 (ihdr + 4, height);
+      write_chunk (os, "IHDR", ihdr, sizeof (ihdr));
+
+      static const char text[] = "Author\0" PACKAGE_STRING;
+      write_chunk (os, "tEXt", reinterpret_cast <const unsigned char *> (text),
+		   sizeof (text) - 1);
+      if (region)
+	{
+	  std::string chunk = std::string ("Region", 7) + region;
+	  write_chunk (os, "tEXt",
+		       reinterpret_cast <const unsigned char *> (chunk.data ()),
+		       chunk.size ());
+	}
+
+      // The zlib header, with the same compression level hint that zlib
+      // would use.
+      int level = s.options.level;
+      int hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+      unsigned int header = (0x78 << 8) | (hint << 6);
+      header += 31 - header % 31;
+      unsigned char zhdr[2] = { (unsigned char) (header >> 8),
+				(unsigned char) header };
+      write_chunk (os, "IDAT", zhdr, 2);
+      return os ? true : fail ();
+    }
+#endif
+
   png_structp png_ptr;
   png_infop info_ptr;
 
@@ -50,64 +444,205 @@ bool write_png (std::ostream & os, const char *img, int width, int height)
   png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
   if (png_ptr == NULL)
-    return false;
+    return fail ();
 
   // Allocate/initialize the image information data.
   info_ptr = png_create_info_struct (png_ptr);
+  state->png_ptr = png_ptr;
   if (info_ptr == NULL)
-    {
-      png_destroy_write_struct (&png_ptr, (png_infopp) NULL);
-      return (false);
-    }
+    return fail ();
+
+  state->info_ptr = info_ptr;
 
   // Set error handling.
   if (setjmp (png_jmpbuf (png_ptr)))
     {
-      // If we get here, we had a problem reading the file
-      png_destroy_write_struct (&png_ptr, &info_ptr);
-      return (false);
+      // If we get here, we had a problem writing the file
+      return fail ();
     }
 
   png_set_write_fn (png_ptr, static_cast <void *> (&os),
 		    user_write_data, user_flush_data);
 
-  // set the zlib compression level
-  png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+  // set the zlib compression level and the filters
+  png_set_compression_level (png_ptr, options.level);
+  if (options.filter != PngOptions::adaptive)
+    png_set_filter (png_ptr, 0, PNG_FILTER_NONE << options.filter);
 
   png_set_IHDR (png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
 		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
 		PNG_FILTER_TYPE_BASE);
 
-  png_text text_ptr[1];
+  png_text text_ptr[2];
+  memset (text_ptr, 0, sizeof (text_ptr));
   text_ptr[0].key = "Author";
   text_ptr[0].text = PACKAGE_STRING;
   text_ptr[0].compression = PNG_TEXT_COMPRESSION_NONE;
-#ifdef PNG_iTXt_SUPPORTED
-  text_ptr[0].lang = NULL;
+  text_ptr[1].key = const_cast <char *> ("Region");
+  text_ptr[1].text = const_cast <char *> (region);
+  text_ptr[1].compression = PNG_TEXT_COMPRESSION_NONE;
+  png_set_text (png_ptr, info_ptr, text_ptr, region ? 2 : 1);
+
+  png_write_info (png_ptr, info_ptr);
+  return (true);
+}
+
+bool PngWriter::write_rows (const char *rows, int n)
+{
+  if (!state)
+    return (false);
+
+#ifdef HAVE_ZLIB
+  // Encode a few strips per thread at a time, to bound the memory used.
+  if (!state->png_ptr)
+    {
+      int batch = state->strip_rows * state->options.threads * 2;
+      for (int first = 0; first < n; first += batch)
+	if (!write_strips (rows + first * state->row_bytes,
+			   std::min (batch, n - first)))
+	  return (false);
+
+      return (true);
+    }
 #endif
-  png_set_text (png_ptr, info_ptr, text_ptr, 1);
 
-  // The easiest way to write the image (you may have a different memory
-  // layout, however, so choose what fits your needs best).  You need to
-  // use the first method if you aren't handling interlacing yourself.
-  //
-  png_bytep *row_pointers = new png_bytep[height];
-  for (int k = 0; k < height; k++)
-    row_pointers[k] = reinterpret_cast <png_byte *> (
-			const_cast <char *> (img + k * width * 3));
+  if (setjmp (png_jmpbuf (state->png_ptr)))
+    return fail ();
 
-  png_write_info (png_ptr, info_ptr);
-  png_write_image (png_ptr, row_pointers);
-  png_write_end (png_ptr, info_ptr);
-  png_destroy_write_struct (&png_ptr, &info_ptr);
+  for (int k = 0; k < n; k++)
+    png_write_row (state->png_ptr, reinterpret_cast <png_bytep> (
+		     const_cast <char *> (rows + k * state->row_bytes)));
+  return (true);
+}
+
+bool PngWriter::end ()
+{
+  if (!state)
+    return (false);
+
+#ifdef HAVE_ZLIB
+  // Finish the deflate data with an empty final block, then write the
+  // checksum of the zlib stream.
+  if (!state->png_ptr)
+    {
+      unsigned char trailer[6] = { 3, 0 };
+      put_be32 (trailer + 2, state->adler);
+      write_chunk (*state->os, "IDAT", trailer, 6);
+      write_chunk (*state->os, "IEND", NULL, 0);
+      bool ok = !state->os->fail ();
+      delete state;
+      state = NULL;
+      return ok;
+    }
+#endif
+
+  if (setjmp (png_jmpbuf (state->png_ptr)))
+    return fail ();
 
+  png_write_end (state->png_ptr, state->info_ptr);
+  png_destroy_write_struct (&state->png_ptr, &state->info_ptr);
+  delete state;
+  state = NULL;
   return (true);
 }
 
+static void user_read_data (png_structp png_ptr, png_bytep data,
+			    png_size_t length)
+{
+  std::istream *is = reinterpret_cast <std::istream *> (png_get_io_ptr(png_ptr));
+  if (!is->read (reinterpret_cast <char *> (data), length))
+    png_error (png_ptr, "unexpected end of file");
+}
+
+bool read_png (std::istream &is, std::vector<unsigned char> &rgb,
+	       int &width, int &height, std::string &region)
+{
+  png_structp png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING,
+						NULL, NULL, NULL);
+  if (png_ptr == NULL)
+    return (false);
+
+  png_infop info_ptr = png_create_info_struct (png_ptr);
+  if (info_ptr == NULL || setjmp (png_jmpbuf (png_ptr)))
+    {
+      png_destroy_read_struct (&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+      return (false);
+    }
+
+  png_set_read_fn (png_ptr, static_cast <void *> (&is), user_read_data);
+  png_read_info (png_ptr, info_ptr);
+
+  // Ask libpng to convert anything else to 8-bit RGB.
+  png_set_expand (png_ptr);
+  png_set_strip_16 (png_ptr);
+  png_set_strip_alpha (png_ptr);
+  png_set_gray_to_rgb (png_ptr);
+  int passes = png_set_interlace_handling (png_ptr);
+  png_read_update_info (png_ptr, info_ptr);
+
+  width = png_get_image_width (png_ptr, info_ptr);
+  height = png_get_image_height (png_ptr, info_ptr);
+  rgb.resize ((size_t) 3 * width * height);
+
+  png_textp text;
+  int n_text = 0;
+  png_get_text (png_ptr, info_ptr, &text, &n_text);
+  region.clear ();
+  for (int k = 0; k < n_text; k++)
+    if (strcmp (text[k].key, "Region") == 0)
+      region = text[k].text;
+
+  for (int pass = 0; pass < passes; pass++)
+    for (int y = 0; y < height; y++)
+      png_read_row (png_ptr, &rgb[(size_t) 3 * width * y], NULL);
+
+  png_read_end (png_ptr, NULL);
+  png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+  return (true);
+}
+
+// Scrive un file PNG utilizzando la libreria libpng.
+
+bool write_png (std::ostream & os, const char *img, int width, int height,
+		const PngOptions &options)
+{
+  PngWriter png;
+  return png.begin (os, width, height, options)
+	 && png.write_rows (img, height)
+	 && png.end ();
+}
+
 #else
 
 // Niente libpng, ritorna errore.
-bool write_png (std::ostream & os, const char *img, int width, int height)
+bool read_png (std::istream &is, std::vector<unsigned char> &rgb,
+	       int &width, int &height, std::string &region)
+{
+  return (false);
+}
+
+bool write_png (std::ostream & os, const char *img, int width, int height,
+		const PngOptions &options)
+{
+  return (false);
+}
+
+PngWriter::~PngWriter ()
+{
+}
+
+bool PngWriter::begin (std::ostream &os, int width, int height,
+		       const PngOptions &options, const char *region)
+{
+  return (false);
+}
+
+bool PngWriter::write_rows (const char *rows, int n)
+{
+  return (false);
+}
+
+bool PngWriter::end ()
 {
   return (false);
 }
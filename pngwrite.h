@@ -6,10 +6,77 @@
 #define PTGEN_PNGWRITE_H
 
 #include <iostream>
+#include <string>
+#include <vector>
+
+// How to compress PNG files.
+struct PngOptions {
+  enum { adaptive = -1 };
+
+  int level;		// zlib compression level, 0 to 9
+  int filter;		// filter type for all rows, from 0 (none) to 4
+			// (Paeth), or ADAPTIVE to choose one for each row
+  int threads;		// encoding threads, 0 means one per processor;
+			// with one thread the image is written by libpng
+
+  PngOptions () : level (9), filter (adaptive), threads (0) {}
+};
+
+// Return the filter type called NAME (none, sub, up, average, paeth or
+// adaptive), or -2 if there is no such filter.
+int parse_png_filter (const char *name);
 
 // Scrive un file PNG utilizzando la libreria libpng.  Se questa non
 // e' disponibile, o se c'e' un errore, ritorna false.
 
-bool write_png (std::ostream & os, const char *img, int width, int height);
+bool write_png (std::ostream & os, const char *img, int width, int height,
+		const PngOptions &options = PngOptions ());
+
+// Read a PNG image from IS, converting it to 8-bit RGB without alpha,
+// and store its pixels in RGB and its size in WIDTH and HEIGHT.  Store
+// the text chunk with keyword Region, if there is one, in REGION.
+// Return false if libpng is not available or if there was an error.
+bool read_png (std::istream &is, std::vector<unsigned char> &rgb,
+	       int &width, int &height, std::string &region);
+
+// Writes a PNG file a few rows at a time, so that the whole image never
+// needs to be in memory.  Each method returns false if libpng is not
+// available or if there was an error, after which the other calls do
+// nothing and fail as well.
+//
+// With more than one thread, the rows are encoded the way pigz does it:
+// they are split into strips of fixed size, which are filtered and then
+// deflated in parallel, each with the end of the previous strip as its
+// dictionary.  Each strip ends with a sync flush, so that the deflate
+// streams can be joined into one zlib stream.  The output does not
+// depend on the number of threads.
+class PngWriter {
+  struct State;
+  struct Strip;
+  class StripThread;
+  State *state;
+
+  PngWriter (const PngWriter &);
+  PngWriter &operator = (const PngWriter &);
+
+  bool fail ();
+  bool write_strips (const char *rows, int n);
+
+ public:
+  PngWriter () : state (NULL) {}
+  ~PngWriter ();
+
+  // Write the header of a WIDTH x HEIGHT image to OS.  If REGION is
+  // not NULL, it is stored as a text chunk with keyword Region.
+  bool begin (std::ostream &os, int width, int height,
+	      const PngOptions &options = PngOptions (),
+	      const char *region = NULL);
+
+  // Write the next N rows, each holding 3 * WIDTH bytes.
+  bool write_rows (const char *rows, int n);
+
+  // Finish the file, after all the rows have been written.
+  bool end ();
+};
 
 #endif
@@ -0,0 +1,216 @@
+// Example ray tracing program
+// Spheres and planes stored as structures of arrays
+
+#include "config.h"
+#include "prims.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+// The arrays have LANES extra elements at the end, so that the loops
+// below always run on a full vector.  Empty slots have a negative
+// squared radius and are never hit.
+void SphereArray::resize (int n)
+{
+  cx.assign (n + lanes, 0);
+  cy.assign (n + lanes, 0);
+  cz.assign (n + lanes, 0);
+  r2.assign (n + lanes, -1);
+  x = &cx[0], y = &cy[0], z = &cz[0], rr = &r2[0];
+  n_slots = n;
+}
+
+void SphereArray::use (const real *cx_, const real *cy_, const real *cz_,
+		       const real *r2_, int n)
+{
+  cx.clear (), cy.clear (), cz.clear (), r2.clear ();
+  x = cx_, y = cy_, z = cz_, rr = r2_;
+  n_slots = n;
+}
+
+void SphereArray::set (int k, const Sphere &s)
+{
+  const Point3D &c = s.get_center ();
+  real r = s.get_radius ();
+  cx[k] = c.x, cy[k] = c.y, cz[k] = c.z, r2[k] = r * r;
+}
+
+// Return the number of slots among FIRST to FIRST + N - 1 that hold
+// a sphere.
+int SphereArray::count (int first, int n) const
+{
+  int result = 0;
+  for (int k = 0; k < n; k++)
+    result += rr[first + k] >= 0;
+  return result;
+}
+
+// The kernels below compute the distance for all LANES slots in a loop
+// that the compiler can vectorize, using HUGE to mark misses, and then
+// look for the closest or for any hit in a separate scalar loop.
+// Initially, the closest hit is at infinity, so misses must also be
+// tested for explicitly.
+static const real huge = 1e30;
+
+// Compute the distance from R to the spheres in slots FIRST to FIRST +
+// LANES - 1, or HUGE for those that R misses; store the distance of the
+// nearer intersection, which might be behind the source of R, in NEAR.
+// Return false if R misses all of them.
+inline bool
+SphereArray::distances (const NormRay3D &r, int first, real *tk,
+			real *near) const
+{
+  const real *sx = x + first, *sy = y + first, *sz = z + first;
+  const real *sr2 = rr + first;
+
+  real tpp[lanes], tdc2[lanes];
+  real max_tdc2 = -huge;
+  for (int k = 0; k < lanes; k++)
+    {
+      real px = sx[k] - r.source.x;
+      real py = sy[k] - r.source.y;
+      real pz = sz[k] - r.source.z;
+      tpp[k] = px * r.dir.x + py * r.dir.y + pz * r.dir.z;
+      tdc2[k] = sr2[k] - ((px * px + py * py + pz * pz) - tpp[k] * tpp[k]);
+      max_tdc2 = std::max (max_tdc2, tdc2[k]);
+    }
+
+  // Most of the time the ray misses all the spheres, and there is
+  // no need to compute the square roots.
+  if (max_tdc2 < 0.0)
+    return false;
+
+  for (int k = 0; k < lanes; k++)
+    {
+      real tdc = sqrt (tdc2[k] < 0.0 ? 0 : tdc2[k]);
+      real t1 = tpp[k] - tdc < 0 ? tpp[k] + tdc : tpp[k] - tdc;
+      near[k] = tpp[k] - tdc;
+      tk[k] = tdc2[k] >= 0.0 && t1 > 0 ? t1 : huge;
+    }
+
+  return true;
+}
+
+int SphereArray::closest (const NormRay3D &r, int first, int n, real &t,
+			  bool &from_inside) const
+{
+  STATS_ADD (tests[STATS_SPHERE], count (first, n));
+  real tk[lanes], near[lanes];
+  if (!distances (r, first, tk, near))
+    return -1;
+
+  int hit = -1;
+  for (int k = 0; k < n; k++)
+    if (tk[k] < t && tk[k] < huge)
+      {
+	t = tk[k];
+	from_inside = near[k] < 0;
+	hit = first + k;
+      }
+
+  if (hit != -1)
+    STATS_HIT (STATS_SPHERE);
+  return hit;
+}
+
+int SphereArray::any (const NormRay3D &r, int first, int n, real tmax) const
+{
+  STATS_ADD (tests[STATS_SPHERE], count (first, n));
+  real tk[lanes], near[lanes];
+  if (!distances (r, first, tk, near))
+    return -1;
+
+  for (int k = 0; k < n; k++)
+    if (tk[k] < tmax)
+      {
+	STATS_HIT (STATS_SPHERE);
+	return first + k;
+      }
+
+  return -1;
+}
+
+void PlaneArray::clear ()
+{
+  count = 0;
+  nx.clear ();
+  ny.clear ();
+  nz.clear ();
+  d.clear ();
+}
+
+// The arrays grow by LANES elements at a time.  Empty slots have a null
+// normal and are never hit.
+void PlaneArray::add (const Plane &p)
+{
+  if (count % lanes == 0)
+    {
+      nx.resize (count + lanes, 0);
+      ny.resize (count + lanes, 0);
+      nz.resize (count + lanes, 0);
+      d.resize (count + lanes, 0);
+    }
+
+  const UnitVector3D &n = p.get_normal ();
+  nx[count] = n.x, ny[count] = n.y, nz[count] = n.z;
+  d[count] = p.get_offset ();
+  count++;
+}
+
+int PlaneArray::closest (const NormRay3D &r, real &t) const
+{
+  STATS_ADD (tests[STATS_PLANE], count);
+  int hit = -1;
+  for (int first = 0; first < count; first += lanes)
+    {
+      real tk[lanes];
+      for (int k = 0; k < lanes; k++)
+	{
+	  int n = first + k;
+	  real denom = r.dir.x * nx[n] + r.dir.y * ny[n] + r.dir.z * nz[n];
+	  real dist = r.source.x * nx[n] + r.source.y * ny[n]
+		      + r.source.z * nz[n] + d[n];
+	  real t1 = -dist / (denom == 0.0 ? 1 : denom);
+	  tk[k] = denom != 0.0 && t1 > 0 ? t1 : huge;
+	}
+
+      for (int k = 0; k < lanes && first + k < count; k++)
+	if (tk[k] < t && tk[k] < huge)
+	  {
+	    t = tk[k];
+	    hit = first + k;
+	  }
+    }
+
+  if (hit != -1)
+    STATS_HIT (STATS_PLANE);
+  return hit;
+}
+
+int PlaneArray::any (const NormRay3D &r, real tmax) const
+{
+  STATS_ADD (tests[STATS_PLANE], count);
+  for (int first = 0; first < count; first += lanes)
+    {
+      real tk[lanes];
+      for (int k = 0; k < lanes; k++)
+	{
+	  int n = first + k;
+	  real denom = r.dir.x * nx[n] + r.dir.y * ny[n] + r.dir.z * nz[n];
+	  real dist = r.source.x * nx[n] + r.source.y * ny[n]
+		      + r.source.z * nz[n] + d[n];
+	  real t1 = -dist / (denom == 0.0 ? 1 : denom);
+	  tk[k] = denom != 0.0 && t1 > 0 ? t1 : huge;
+	}
+
+      for (int k = 0; k < lanes; k++)
+	if (tk[k] < tmax)
+	  {
+	    STATS_HIT (STATS_PLANE);
+	    return first + k;
+	  }
+    }
+
+  return -1;
+}
@@ -0,0 +1,82 @@
+// Example ray tracing program
+// Spheres and planes stored as structures of arrays
+
+#ifndef PTGEN_PRIMS_H
+#define PTGEN_PRIMS_H
+
+#include "config.h"
+#include "v3d.h"
+#include "geom.h"
+
+#include <vector>
+
+// Spheres stored as separate arrays of coordinates and squared radii,
+// so that one ray can be tested against several spheres with vector
+// instructions.  Slots that were never set hold no sphere.
+class SphereArray {
+  std::vector<real> cx, cy, cz, r2;
+
+  // The arrays that are used: the vectors above after resize (), or
+  // the ones given to use ().
+  const real *x, *y, *z, *rr;
+  int n_slots;
+
+  bool distances (const NormRay3D &r, int first, real *tk, real *near) const;
+  int count (int first, int n) const;
+
+ public:
+  // Number of spheres that are tested together.
+  enum { lanes = 8 };
+
+  SphereArray () : x (NULL), y (NULL), z (NULL), rr (NULL), n_slots (0) {}
+
+  // Make room for N spheres, all slots empty.
+  void resize (int n);
+  void set (int k, const Sphere &s);
+
+  // Use N spheres from arrays that live elsewhere, for example in a file
+  // mapped in memory, and have LANES extra elements at the end like the
+  // ones built by resize () and set ().
+  void use (const real *cx_, const real *cy_, const real *cz_,
+	    const real *r2_, int n);
+
+  // Return the arrays of coordinates and squared radii, with N + LANES
+  // elements each.
+  int size () const { return n_slots; }
+  const real *get_x () const { return x; }
+  const real *get_y () const { return y; }
+  const real *get_z () const { return z; }
+  const real *get_r2 () const { return rr; }
+
+  // Find the closest hit of R with slots FIRST to FIRST + N - 1, where N
+  // is at most LANES, that is closer than T.  If there is one, store its
+  // distance in T and whether R starts inside the sphere in FROM_INSIDE,
+  // and return the slot; otherwise return -1.
+  int closest (const NormRay3D &r, int first, int n, real &t,
+	       bool &from_inside) const;
+
+  // Return a slot among FIRST to FIRST + N - 1 that R hits before TMAX,
+  // or -1.
+  int any (const NormRay3D &r, int first, int n, real tmax) const;
+};
+
+// Likewise for planes.  Planes are added one after another and tested
+// all together.
+class PlaneArray {
+  std::vector<real> nx, ny, nz, d;
+  int count;
+
+ public:
+  enum { lanes = 8 };
+
+  PlaneArray () : count (0) {}
+
+  int size () const { return count; }
+  void clear ();
+  void add (const Plane &p);
+
+  int closest (const NormRay3D &r, real &t) const;
+  int any (const NormRay3D &r, real tmax) const;
+};
+
+#endif
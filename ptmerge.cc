@@ -0,0 +1,152 @@
+// Example ray tracing program
+// Put together the regions of an image rendered with --region
+
+#include "config.h"
+#include "images.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+static void
+usage (char *progname, int exit_status)
+{
+  std::cerr << "Usage: " << progname << " [OPTIONS...] FILES...\n"
+"\n"
+"Join PPM or PNG files written with --region into the whole image.\n"
+"\n"
+" -o, --output-file=NAME   set output file name (- = stdout)\n"
+" -f, --file-format=FORMAT set output file format (ppm, png)\n\n";
+
+  std::exit (exit_status);
+}
+
+int main (int argc, char **argv)
+{
+  const char *output_filename = NULL;
+#ifdef HAVE_LIBPNG
+  enum image_file_format output_format = OUT_PNG;
+  const char *default_output_file = "ptgen.png";
+#else
+  enum image_file_format output_format = OUT_PPM;
+  const char *default_output_file = "ptgen.ppm";
+#endif
+
+  while (1)
+    {
+      static struct option long_options[] =
+        {
+          {"help",    no_argument, 	      0, 1},
+          {"file-format", required_argument,  0, 'f'},
+          {"output-file",  required_argument, 0, 'o'},
+          {0, 0, 0, 0}
+        };
+      int option_index = 0;
+      int c = getopt_long (argc, argv, "f:o:", long_options, &option_index);
+      if (c == -1)
+	break;
+
+      switch (c)
+	{
+	case 1:
+	  usage (argv[0], 0);
+	  break;
+
+	case 'o':
+	  output_filename = optarg;
+	  break;
+
+	case 'f':
+	  if (std::strcmp (optarg, "ppm") == 0)
+	    {
+	      output_format = OUT_PPM;
+	      default_output_file = "ptgen.ppm";
+	    }
+#ifdef HAVE_LIBPNG
+	  else if (std::strcmp (optarg, "png") == 0)
+	    {
+	      output_format = OUT_PNG;
+	      default_output_file = "ptgen.png";
+	    }
+#endif
+	  else
+	    {
+	      std::cerr << "Invalid file format" << std::endl;
+	      usage (argv[0], 1);
+	    }
+	  break;
+
+	default:
+	  usage (argv[0], 1);
+	}
+    }
+
+  if (optind == argc)
+    usage (argv[0], 1);
+  if (!output_filename)
+    output_filename = default_output_file;
+
+  // Copy each region to its place, counting the pixels that no region
+  // covers.
+  Image result;
+  std::vector<bool> covered;
+  int width = 0, height = 0;
+  for (int n = optind; n < argc; n++)
+    {
+      Image part;
+      ImageRegion region;
+      if (!part.read (argv[n], region))
+	{
+	  std::cerr << "Cannot read " << argv[n] << std::endl;
+	  return 1;
+	}
+      if (region.empty ())
+	{
+	  std::cerr << argv[n] << " is not a region of an image" << std::endl;
+	  return 1;
+	}
+
+      if (n == optind)
+	{
+	  width = region.full_width;
+	  height = region.full_height;
+	  result.set_size (width, height);
+	  std::memset (result.get_image_data (), 0, (size_t) 3 * width * height);
+	  covered.assign ((size_t) width * height, false);
+	}
+
+      int w = part.get_width (), h = part.get_height ();
+      if (region.full_width != width || region.full_height != height
+	  || region.x + w > width || region.y + h > height)
+	{
+	  std::cerr << argv[n] << " does not fit in a " << width << 'x'
+		    << height << " image" << std::endl;
+	  return 1;
+	}
+
+      for (int y = 0; y < h; y++)
+	{
+	  size_t offset = (size_t) (region.y + y) * width + region.x;
+	  std::memcpy (result.get_image_data () + 3 * offset,
+		       part.get_image_data () + (size_t) 3 * y * w, 3 * w);
+	  std::fill (covered.begin () + offset, covered.begin () + offset + w,
+		     true);
+	}
+    }
+
+  long missing = std::count (covered.begin (), covered.end (), false);
+  if (missing)
+    std::cerr << "Warning: " << missing << " pixels are not in any region"
+	      << std::endl;
+
+  bool error;
+  if (std::strcmp (output_filename, "-") == 0)
+    error = result.write (std::cout, output_format);
+  else
+    error = result.write (output_filename, output_format);
+
+  return error ? 1 : 0;
+}
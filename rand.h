@@ -28,7 +28,7 @@ public:
     {
       s1 = 30903 * (s1 & 65535) + (s1>>16);
       s2 = 18000 * (s2 & 65535) + (s2>>16);
-      return ((s1<<16)+s2) / 4294967295.0;
+      return (((s1<<16)+s2) & 0xFFFFFFFFUL) / 4294967295.0;
     };
 };
 
@@ -0,0 +1,49 @@
+// Example ray tracing program
+// Render a scene read from a scene description file
+
+#include "images.h"
+#include "scene.h"
+#include "scenefile.h"
+
+#include <iostream>
+#include <cstring>
+#include <string>
+
+int main (int argc, char **argv)
+{
+  if (argc == 4 && std::strcmp (argv[1], "--compile") == 0)
+    {
+      std::string error;
+      if (compile_scene (argv[2], argv[3], error))
+	return 0;
+
+      std::cerr << error << std::endl;
+      return 1;
+    }
+
+  if (argc < 2 || (argv[1][0] == '-' && argv[1][1] != '\0'))
+    {
+      std::cerr << "Usage: " << argv[0] << " SCENE-FILE [OPTIONS...]\n"
+		<< "       " << argv[0] << " --compile SCENE-FILE CACHE-FILE"
+		<< std::endl;
+
+      // Let the options parser describe the options.
+      if (argc >= 2 && std::strcmp (argv[1], "--help") == 0)
+	Scene ().render (SceneSettings ().camera, argc, argv);
+      return 1;
+    }
+
+  Scene scene;
+  SceneSettings settings;
+  std::string error;
+  if (!load_scene (argv[1], scene, settings, error))
+    {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+
+  // The scene file stays among the arguments; it is not an option,
+  // so the options parser skips it and passes it on to the workers.
+  scene.render (settings.camera, argc, argv, settings.width,
+		settings.height);
+}
@@ -3,16 +3,320 @@
 
 #include "scene.h"
 #include "rand.h"
+#include "thread.h"
+#include "tiles.h"
 
+#include <algorithm>
+#include <vector>
+#include <typeinfo>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <getopt.h>
 
-void Scene::render (const Ray3D &camera, Image &m, int max_ref) const
+struct Scene::RenderJob {
+  const Scene &scene;
+  Image &m;
+  RenderOptions options;
+
+  Point3D source;
+  Vector3D leftmost_dir, x_step, y_step;
+  int x_offset, y_offset;
+
+  TileScheduler tiles;
+  bool progress;
+  Mutex progress_lock;
+
+  // Render rows FIRST_ROW to LAST_ROW - 1 of M.
+  RenderJob (const Scene &scene_, Image &m_, const RenderOptions &options_,
+	     int threads, int first_row, int last_row) :
+    scene (scene_), m (m_), options (options_), x_offset (0), y_offset (0),
+    tiles (m_.get_width (), first_row, last_row, tile_size, threads),
+    progress (true) {
+    options.threads = threads;
+  }
+
+  void set_camera (const Ray3D &camera, int w, int h, int x_offset_,
+		   int y_offset_);
+
+  // Return the direction of the camera ray through point (X, Y) of M;
+  // pixel centers have integer coordinates.
+  Vector3D pixel_dir (real x, real y) const {
+    return leftmost_dir + y_step * (y + y_offset) + x_step * (x + x_offset);
+  }
+
+  // The color seen through a point of the image, and the object that
+  // the camera ray hit there, if any.
+  struct Sample {
+    Color c;
+    const Object *o;
+  };
+
+  void sample (TraceState &state, const real *xs, const real *ys, int n,
+	       Sample *out);
+  Color refine (TraceState &state, real x, real y, real size,
+		const Sample &s00, const Sample &s10,
+		const Sample &s01, const Sample &s11, int depth);
+
+  void render_tile (TraceState &state, const Tile &t);
+  void render_packets (TraceState &state, const Tile &t);
+  void render_adaptive (TraceState &state, const Tile &t);
+};
+
+class Scene::RenderThread : public Thread {
+  RenderJob &job;
+  int index;
+  TraceState state;
+
+ public:
+  RenderThread (RenderJob &job_, int index_) :
+    job (job_), index (index_), state (job_.scene, job_.options, index_) {}
+  void run ();
+  const RenderStats &get_stats () const { return state.stats; }
+  const TraceStats &get_trace_stats () const { return state.trace_stats; }
+};
+
+// Trace the camera rays through the N points (XS[k], YS[k]) of the image
+// and store what they see in OUT.  The rays are traced in packets if
+// possible.
+void Scene::RenderJob::sample (TraceState &state, const real *xs,
+			       const real *ys, int n, Sample *out)
+{
+  int max_ref = options.max_ref;
+  state.stats.primary_rays += n;
+  if (options.wavefront)
+    {
+      std::vector<Ray3D> rays (n);
+      std::vector<Color> colors (n);
+      std::vector<const Object *> hits (n);
+      for (int k = 0; k < n; k++)
+	rays[k] = Ray3D (source, pixel_dir (xs[k], ys[k]));
+
+      scene.trace_wave (state, &rays[0], n, max_ref, &colors[0], &hits[0]);
+      for (int k = 0; k < n; k++)
+	{
+	  out[k].c = colors[k];
+	  out[k].o = hits[k];
+	}
+      return;
+    }
+
+  if (RayPacket::size == 1)
+    {
+      for (int k = 0; k < n; k++)
+	{
+	  Ray3D ray (source, pixel_dir (xs[k], ys[k]));
+	  Intersection i (ray);
+	  if (scene.compute_intersection (i))
+	    {
+	      out[k].c = scene.shade (state, ray, i, max_ref, 1.0);
+	      out[k].o = i.object;
+	    }
+	  else
+	    {
+	      out[k].c = Color (0.0, 0.0, 0.0);
+	      out[k].o = NULL;
+	    }
+	}
+      return;
+    }
+
+  RayPacket p;
+  Ray3D rays[RayPacket::size];
+  for (int first = 0; first < n; first += RayPacket::size)
+    {
+      // Rays past the N-th are inactive, but they are set anyway
+      // so that the packet holds no garbage.
+      int count = std::min (n - first, (int) RayPacket::size);
+      for (int k = 0; k < RayPacket::size; k++)
+	{
+	  int j = first + (k < count ? k : 0);
+	  rays[k] = Ray3D (source, pixel_dir (xs[j], ys[j]));
+	  p.set_ray (k, rays[k]);
+	}
+
+      // From here on the rays diverge, and each is followed separately.
+      PacketMask active = RayPacket::all () >> (RayPacket::size - count);
+      scene.compute_intersection (p, active);
+      for (int k = 0; k < count; k++)
+	{
+	  Sample &s = out[first + k];
+	  if (p.entity[k])
+	    {
+	      s.c = scene.shade (state, rays[k], Intersection (p, k),
+				 max_ref, 1.0);
+	      s.o = p.object[k];
+	    }
+	  else
+	    {
+	      s.c = Color (0.0, 0.0, 0.0);
+	      s.o = NULL;
+	    }
+	}
+    }
+}
+
+// Camera rays are traced in packets of RayPacket::size, covering
+// a block of packet_width by packet_height pixels.
+static const int packet_width = RayPacket::size >= 8 ? 4
+				: RayPacket::size >= 4 ? 2 : 1;
+static const int packet_height = RayPacket::size / packet_width;
+
+void Scene::RenderJob::render_packets (TraceState &state, const Tile &t)
+{
+  // The wavefront tracer works best with all the pixels at once.
+  if (options.wavefront)
+    {
+      int n = (t.x1 - t.x0) * (t.y1 - t.y0);
+      std::vector<real> xs (n), ys (n);
+      std::vector<Sample> out (n);
+      for (int k = 0; k < n; k++)
+	{
+	  xs[k] = t.x0 + k % (t.x1 - t.x0);
+	  ys[k] = t.y0 + k / (t.x1 - t.x0);
+	}
+
+      sample (state, &xs[0], &ys[0], n, &out[0]);
+      for (int k = 0; k < n; k++)
+	m.set_pixel ((int) xs[k], (int) ys[k], out[k].c);
+      return;
+    }
+
+  real xs[RayPacket::size], ys[RayPacket::size];
+  Sample out[RayPacket::size];
+  for (int i = t.y0; i < t.y1; i += packet_height)
+    for (int j = t.x0; j < t.x1; j += packet_width)
+      {
+	int n = 0;
+	for (int k = 0; k < RayPacket::size; k++)
+	  {
+	    int x = j + k % packet_width;
+	    int y = i + k / packet_width;
+	    if (x < t.x1 && y < t.y1)
+	      xs[n] = x, ys[n] = y, n++;
+	  }
+
+	sample (state, xs, ys, n, out);
+	for (int k = 0; k < n; k++)
+	  m.set_pixel ((int) xs[k], (int) ys[k], out[k].c);
+      }
+}
+
+// Return the average of four colors.  Color's operators saturate at
+// each step, so they are not used.
+static inline Color average (const Color &a, const Color &b,
+			     const Color &c, const Color &d)
+{
+  return Color ((a.r + b.r + c.r + d.r) * 0.25,
+		(a.g + b.g + c.g + d.g) * 0.25,
+		(a.b + b.b + c.b + d.b) * 0.25);
+}
+
+// Return the difference between the largest and smallest of four values.
+static inline real spread (real a, real b, real c, real d)
+{
+  return std::max (std::max (a, b), std::max (c, d))
+	 - std::min (std::min (a, b), std::min (c, d));
+}
+
+// Return the color of the square of side SIZE whose top left corner is
+// (X, Y), given the samples at its corners.  If the corners hit
+// different objects or their colors differ by more than the threshold,
+// split the square in four, at most DEPTH times.
+Color Scene::RenderJob::refine (TraceState &state, real x, real y, real size,
+				const Sample &s00, const Sample &s10,
+				const Sample &s01, const Sample &s11, int depth)
+{
+  if (depth == 0
+      || (s00.o == s10.o && s00.o == s01.o && s00.o == s11.o
+	  && spread (s00.c.r, s10.c.r, s01.c.r, s11.c.r) <= options.aa_threshold
+	  && spread (s00.c.g, s10.c.g, s01.c.g, s11.c.g) <= options.aa_threshold
+	  && spread (s00.c.b, s10.c.b, s01.c.b, s11.c.b) <= options.aa_threshold))
+    return average (s00.c, s10.c, s01.c, s11.c);
+
+  // Sample the middle of each side and the center, in this order:
+  // top, left, center, right, bottom.
+  real h = size / 2;
+  real xs[5] = { x + h, x, x + h, x + size, x + h };
+  real ys[5] = { y, y + h, y + h, y + h, y + size };
+  Sample s[5];
+  sample (state, xs, ys, 5, s);
+
+  return average (refine (state, x, y, h, s00, s[0], s[1], s[2], depth - 1),
+		  refine (state, x + h, y, h, s[0], s10, s[2], s[3], depth - 1),
+		  refine (state, x, y + h, h, s[1], s[2], s01, s[4], depth - 1),
+		  refine (state, x + h, y + h, h, s[2], s[3], s[4], s11,
+			  depth - 1));
+}
+
+// Render T with adaptive anti-aliasing: sample the corners of every
+// pixel, and refine the pixels whose corners differ.
+void Scene::RenderJob::render_adaptive (TraceState &state, const Tile &t)
+{
+  int w = t.x1 - t.x0 + 1;
+  int h = t.y1 - t.y0 + 1;
+  std::vector<Sample> corners (w * h);
+  std::vector<real> xs (w), ys (w);
+  for (int i = 0; i < h; i++)
+    {
+      for (int j = 0; j < w; j++)
+	{
+	  xs[j] = t.x0 + j - 0.5;
+	  ys[j] = t.y0 + i - 0.5;
+	}
+      sample (state, &xs[0], &ys[0], w, &corners[i * w]);
+    }
+
+  for (int i = 0; i < h - 1; i++)
+    for (int j = 0; j < w - 1; j++)
+      {
+	const Sample *row = &corners[i * w + j];
+	m.set_pixel (t.x0 + j, t.y0 + i,
+		     refine (state, t.x0 + j - 0.5, t.y0 + i - 0.5, 1.0,
+			     row[0], row[1], row[w], row[w + 1],
+			     options.aa_depth));
+      }
+}
+
+void Scene::RenderJob::render_tile (TraceState &state, const Tile &t)
+{
+  state.stats.pixels += (t.x1 - t.x0) * (t.y1 - t.y0);
+  if (options.aa_depth > 0)
+    render_adaptive (state, t);
+  else
+    render_packets (state, t);
+
+  if (progress)
+    {
+      MutexLock l (progress_lock);
+      std::cerr << '.';
+    }
+}
+
+void Scene::RenderThread::run ()
+{
+#ifdef ENABLE_STATS
+  current_stats = &state.trace_stats;
+#endif
+
+  Tile t;
+  while (job.tiles.get_tile (index, t))
+    job.render_tile (state, t);
+
+#ifdef ENABLE_STATS
+  current_stats = NULL;
+#endif
+}
+
+// Point the camera rays along CAMERA, for an image of W x H pixels
+// of which M holds the part whose top-left corner is (X_OFFSET, Y_OFFSET).
+void Scene::RenderJob::set_camera (const Ray3D &camera, int w, int h,
+				   int x_offset_, int y_offset_)
 {
   // Rotate by 90 degrees around the Y axis
   Vector3D x_vec_unit (camera.dir.z, camera.dir.y, -camera.dir.x);
@@ -21,11 +325,7 @@ void Scene::render (const Ray3D &camera, Image &m, int max_ref) const
   // the wrong orientation of the Y axis on the screen)
   Vector3D y_vec_unit (-camera.dir.x, -camera.dir.z, camera.dir.y);
 
-  int w = m.get_width ();
-  int h = m.get_height ();
-
   real vec_step;
-  Vector3D leftmost_dir;
 
   if (w < h)
     {
@@ -38,14 +338,350 @@ void Scene::render (const Ray3D &camera, Image &m, int max_ref) const
       leftmost_dir = camera.dir - x_vec_unit * w / h - y_vec_unit;
     }
 
-  for (int i = 0; i < h; i++, leftmost_dir += y_vec_unit * vec_step)
+  source = camera.source;
+  x_step = x_vec_unit * vec_step;
+  y_step = y_vec_unit * vec_step;
+  x_offset = x_offset_;
+  y_offset = y_offset_;
+}
+
+// Return how many threads should render a W x H image.
+static int count_threads (const RenderOptions &options, int w, int h)
+{
+  int n_tiles = ((w + tile_size - 1) / tile_size)
+		* ((h + tile_size - 1) / tile_size);
+  int threads = options.threads;
+  if (threads <= 0)
+    threads = num_processors ();
+  if (threads > n_tiles)
+    threads = n_tiles;
+  return threads;
+}
+
+// Render all the tiles of JOB and add the counts to the totals for the
+// current call to render ().
+void Scene::run (RenderJob &job) const
+{
+  // The calling thread renders too, so start one thread less.
+  std::vector<RenderThread *> workers;
+  for (int k = 1; k < job.options.threads; k++)
     {
-      Vector3D dir = leftmost_dir;
-      for (int j = 0; j < w; j++, dir += x_vec_unit * vec_step)
-	m.set_pixel (j, i, trace (Ray3D (camera.source, dir), max_ref, 1.0));
-      std::cerr << '.';
+      workers.push_back (new RenderThread (job, k));
+      workers.back ()->start ();
+    }
+
+  RenderThread self (job, 0);
+  self.run ();
+
+  last_stats += self.get_stats ();
+  last_trace_stats += self.get_trace_stats ();
+  for (size_t k = 0; k < workers.size (); k++)
+    {
+      workers[k]->join ();
+      last_stats += workers[k]->get_stats ();
+      last_trace_stats += workers[k]->get_trace_stats ();
+      delete workers[k];
+    }
+}
+
+void Scene::render (const Ray3D &camera, Image &m,
+		    const RenderOptions &options) const
+{
+  double start = now ();
+  prepare ();
+
+  int w = m.get_width ();
+  int h = m.get_height ();
+  RenderJob job (*this, m, options, count_threads (options, w, h), 0, h);
+  job.set_camera (camera, w, h, 0, 0);
+
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+  run (job);
+
+  last_stats.seconds = now () - start;
+  std::cerr << std::endl;
+}
+
+// Writes out a sequence of images on its own thread, while the
+// following ones are rendered.  There are two buffers, so that one
+// image can be rendered while the other is being written.
+class ImageQueue : public Thread {
+  int n_images;
+  Image buffers[2];
+  bool full[2];
+  bool ok;
+
+  Mutex lock;
+  Condition changed;
+
+ protected:
+  // Write image number K.  Return false if there was an error.
+  virtual bool write (int k, const Image &m) = 0;
+
+ public:
+  explicit ImageQueue (int n_images_) : n_images (n_images_), ok (true) {
+    full[0] = full[1] = false;
+  }
+
+  bool get_ok () const { return ok; }
+
+  // Return an empty W x H buffer for image number K, waiting until
+  // the image that used the same buffer has been written.
+  Image &get (int k, int w, int h);
+
+  // Queue image number K for writing.
+  void put (int k);
+
+  void run ();
+};
+
+Image &ImageQueue::get (int k, int w, int h)
+{
+  Image &m = buffers[k % 2];
+#ifdef HAVE_PTHREAD
+  {
+    MutexLock l (lock);
+    while (full[k % 2])
+      changed.wait (lock);
+  }
+#endif
+
+  if (m.get_image_data () == NULL
+      || m.get_width () != w || m.get_height () != h)
+    m.set_size (w, h);
+  return m;
+}
+
+void ImageQueue::put (int k)
+{
+#ifdef HAVE_PTHREAD
+  MutexLock l (lock);
+  full[k % 2] = true;
+  changed.broadcast ();
+#else
+  // There is no writing thread, write the image right away.
+  ok &= write (k, buffers[k % 2]);
+#endif
+}
+
+void ImageQueue::run ()
+{
+#ifdef HAVE_PTHREAD
+  for (int k = 0; k < n_images; k++)
+    {
+      {
+	MutexLock l (lock);
+	while (!full[k % 2])
+	  changed.wait (lock);
+      }
+
+      bool image_ok = write (k, buffers[k % 2]);
+
+      MutexLock l (lock);
+      ok &= image_ok;
+      full[k % 2] = false;
+      changed.broadcast ();
+    }
+#endif
+}
+
+// Writes the strips of an image one after another.
+class StripWriter : public ImageQueue {
+  ImageWriter &out;
+
+ protected:
+  bool write (int k, const Image &m) {
+    return out.write_rows (m.get_image_data (), m.get_height ());
+  }
+
+ public:
+  StripWriter (ImageWriter &out_, int n_strips) :
+    ImageQueue (n_strips), out (out_) {}
+};
+
+// Return the name of frame number K given PATTERN, which is either a
+// printf format for the frame number or a file name to which the
+// number is added before the extension.
+static std::string frame_file_name (const char *pattern, int k)
+{
+  char buf[4096];
+  if (std::strchr (pattern, '%'))
+    snprintf (buf, sizeof (buf), pattern, k);
+  else
+    {
+      const char *dot = std::strrchr (pattern, '.');
+      int len = dot ? dot - pattern : std::strlen (pattern);
+      snprintf (buf, sizeof (buf), "%.*s-%04d%s", len, pattern, k,
+		dot ? dot : "");
+    }
+
+  return buf;
+}
+
+// Writes the frames of an animation to numbered files or, if the
+// pattern is "-", one after another to standard output.
+class FrameWriter : public ImageQueue {
+  const char *pattern;
+  enum image_file_format fmt;
+  PngOptions png_options;
+
+ protected:
+  bool write (int k, const Image &m) {
+    // Image::write returns true if there was an error.
+    if (std::strcmp (pattern, "-") == 0)
+      return !m.write (std::cout, fmt, png_options);
+    else
+      return !m.write (frame_file_name (pattern, k).c_str (), fmt,
+		       png_options);
+  }
+
+ public:
+  FrameWriter (const char *pattern_, enum image_file_format fmt_,
+	       const PngOptions &png_options_, int n_frames) :
+    ImageQueue (n_frames), pattern (pattern_), fmt (fmt_),
+    png_options (png_options_) {}
+};
+
+// Render into M the part of a W x H image whose top-left corner is
+// (X0, Y0), without printing progress, and add the counts to the totals
+// for the current call to render ().
+void Scene::render_rect (const Ray3D &camera, int w, int h, int x0, int y0,
+			 Image &m, const RenderOptions &options,
+			 bool progress) const
+{
+  prepare ();
+
+  int mw = m.get_width ();
+  int mh = m.get_height ();
+  RenderJob job (*this, m, options, count_threads (options, mw, mh), 0, mh);
+  job.progress = progress;
+  job.set_camera (camera, w, h, x0, y0);
+  run (job);
+}
+
+void Scene::render (const Ray3D &camera, int w, int h, int x0, int y0,
+		    Image &m, const RenderOptions &options) const
+{
+  double start = now ();
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+  render_rect (camera, w, h, x0, y0, m, options, true);
+  last_stats.seconds = now () - start;
+  std::cerr << std::endl;
+}
+
+void Scene::render (const Ray3D &camera, int w, int h, ImageWriter &out,
+		    const RenderOptions &options) const
+{
+  double start = now ();
+  prepare ();
+
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+
+  // Each strip is one row of tiles, so the tiles are the same as
+  // when rendering the whole image at once.
+  int n_strips = (h + tile_size - 1) / tile_size;
+  int threads = count_threads (options, w, tile_size);
+
+  bool ok = out.begin (w, h);
+  StripWriter writer (out, n_strips);
+#ifdef HAVE_PTHREAD
+  writer.start ();
+#endif
+
+  for (int k = 0; k < n_strips; k++)
+    {
+      int y0 = k * tile_size;
+      int strip_h = std::min (tile_size, h - y0);
+      Image &m = writer.get (k, w, strip_h);
+
+      RenderJob job (*this, m, options, threads, 0, strip_h);
+      job.set_camera (camera, w, h, 0, y0);
+      run (job);
+      writer.put (k);
+    }
+
+  writer.join ();
+  ok &= writer.get_ok ();
+  ok &= out.end ();
+  last_stats.seconds = now () - start;
+  std::cerr << std::endl;
+
+  if (!ok)
+    std::cerr << "File output error." << std::endl;
+}
+
+void Scene::render (const Ray3D &camera, MappedImage &m,
+		    const RenderOptions &options) const
+{
+  double start = now ();
+  prepare ();
+
+  last_stats = RenderStats ();
+  last_trace_stats.clear ();
+
+  int w = m.get_width ();
+  int h = m.get_height ();
+  int threads = count_threads (options, w, tile_size);
+  bool ok = true;
+
+  // Render one row of tiles at a time, starting after the rows that
+  // are already on disk, and record each of them as soon as it is done.
+  int first_row = m.get_rows_done ();
+  if (first_row < h)
+    first_row -= first_row % tile_size;
+  for (int y0 = first_row; ok && y0 < h; y0 += tile_size)
+    {
+      int y1 = std::min (y0 + tile_size, h);
+      RenderJob job (*this, m, options, threads, y0, y1);
+      job.set_camera (camera, w, h, 0, 0);
+      run (job);
+      ok = m.set_rows_done (y1);
     }
+
+  last_stats.seconds = now () - start;
   std::cerr << std::endl;
+
+  if (!ok)
+    std::cerr << "File output error." << std::endl;
+}
+
+void Scene::render (const CameraPath &path, int n_frames, int w, int h,
+		    const char *pattern, enum image_file_format fmt,
+		    const PngOptions &png_options,
+		    const RenderOptions &options) const
+{
+  double start = now ();
+  prepare ();
+
+  RenderStats total;
+  TraceStats total_trace;
+
+  FrameWriter writer (pattern, fmt, png_options, n_frames);
+#ifdef HAVE_PTHREAD
+  writer.start ();
+#endif
+
+  for (int k = 0; k < n_frames; k++)
+    {
+      real t = n_frames == 1 ? 0 : (real) k / (n_frames - 1);
+      Image &m = writer.get (k, w, h);
+      render (path.at (t), m, options);
+      writer.put (k);
+
+      total += last_stats;
+      total_trace += last_trace_stats;
+    }
+
+  writer.join ();
+  last_stats = total;
+  last_trace_stats = total_trace;
+  last_stats.seconds = now () - start;
+
+  if (!writer.get_ok ())
+    std::cerr << "File output error." << std::endl;
 }
 
 // Routine per interpretare il parametro -S (--seed).
@@ -59,6 +695,17 @@ parse_num (const char *c)
   return (bool) iss ? num : -1;
 }
 
+// Likewise for real numbers.
+real
+parse_real (const char *c)
+{
+  std::istringstream iss(c);
+  real num;
+  iss >> num;
+
+  return (bool) iss ? num : -1;
+}
+
 // Stampa l'help.
 void
 usage(char *progname, int exit_status)
@@ -69,7 +716,47 @@ usage(char *progname, int exit_status)
 " -f, --file-format=FORMAT set output file format (ppm, png)\n"
 " -w, --width=SIZE         set output width (must be power of two)\n"
 " -h, --height=SIZE        set output height (must be power of two)\n"
-" -S, --seed=NUMBER        set random number seed\n\n";
+" -S, --seed=NUMBER        set random number seed\n"
+" -t, --threads=NUMBER     set number of rendering threads (default: one\n"
+"                          per processor)\n"
+" -a, --aa-depth=NUMBER    anti-alias edges by splitting pixels up to NUMBER\n"
+"                          times (default 0, 2 is close to 16x supersampling)\n"
+"     --aa-threshold=X     set color difference that is considered an edge\n"
+"                          (default 0.1)\n"
+"     --min-contribution=X do not trace reflections and refractions that\n"
+"                          contribute less than X (default 1/1024, 0 = all)\n"
+"     --roulette=X         trace them with probability proportional to their\n"
+"                          contribution if it is less than X (default: off)\n"
+"     --wavefront          trace the rays of each tile one generation at a\n"
+"                          time\n"
+"     --stream             write the image while it is being rendered,\n"
+"                          keeping only a few rows in memory\n"
+"     --png-level=NUMBER   set PNG compression level, 0 to 9 (default 9)\n"
+"     --png-filter=NAME    set PNG filter (none, sub, up, average, paeth or\n"
+"                          adaptive; default adaptive)\n"
+"     --png-threads=NUMBER set number of PNG encoding threads (default: same\n"
+"                          as --threads; 1 = use libpng)\n"
+"     --frames=NUMBER      render an animation of NUMBER frames, written to\n"
+"                          numbered files (or a printf pattern given with\n"
+"                          -o), or one after another to stdout with -o -\n"
+"     --camera-path=FILE   move the camera along the keyframes in FILE, each\n"
+"                          a line with position and direction (default: turn\n"
+"                          around the vertical axis)\n"
+"     --workers=NUMBER     split the rendering among NUMBER worker processes\n"
+"     --worker-command=CMD also start a worker with the shell command CMD,\n"
+"                          for example \"ssh host ./scene1 --worker\"\n"
+"     --worker             serve a coordinator on stdin and stdout\n"
+"     --region=X,Y,W,H     render only the W x H pixels starting at (X, Y);\n"
+"                          the pieces can be joined with ptmerge\n"
+"     --mmap               render straight into a memory-mapped PPM file\n"
+"     --resume             like --mmap, but continue an interrupted render\n"
+"     --bench[=SIZES]      time the rendering at the given comma-separated\n"
+"                          WIDTHxHEIGHT sizes (default: half, normal and\n"
+"                          double size) and print the results as JSON\n"
+"     --warmup=NUMBER      set number of untimed renders per size (default 1)\n"
+"     --repeat=NUMBER      set number of timed renders per size (default 5)\n"
+"     --stats              print counts of the rays traced and of the\n"
+"                          intersection tests\n\n";
 
   std::exit (exit_status);
 }
@@ -85,6 +772,23 @@ Scene::render (const Ray3D &camera_dir, int argc, char **argv,
   int width = -1;
   int height = -1;
   int seed = std::time(0);
+  RenderOptions options (max_ref);
+  bool bench = false;
+  const char *bench_sizes = NULL;
+  int warmup = 1;
+  int repeat = 5;
+  bool stats = false;
+  bool stream = false;
+  bool mapped = false;
+  bool resume = false;
+  PngOptions png_options;
+  png_options.threads = -1;
+  int frames = 0;
+  const char *camera_path = NULL;
+  WorkerOptions workers;
+  bool worker = false;
+  ImageRegion region;
+  int region_width = 0, region_height = 0;
 
   while (1)
     {
@@ -97,13 +801,35 @@ Scene::render (const Ray3D &camera_dir, int argc, char **argv,
           {"width",   required_argument,      0, 'w'},
           {"height",   required_argument,     0, 'h'},
           {"seed",    required_argument,      0, 'S'},
+          {"threads", required_argument,      0, 't'},
+          {"bench",   optional_argument,      0, 2},
+          {"warmup",  required_argument,      0, 3},
+          {"repeat",  required_argument,      0, 4},
+          {"stats",   no_argument,            0, 5},
+          {"aa-depth", required_argument,     0, 'a'},
+          {"aa-threshold", required_argument, 0, 6},
+          {"min-contribution", required_argument, 0, 7},
+          {"roulette", required_argument,     0, 8},
+          {"wavefront", no_argument,          0, 9},
+          {"stream",  no_argument,            0, 10},
+          {"mmap",    no_argument,            0, 11},
+          {"resume",  no_argument,            0, 12},
+          {"png-level", required_argument,    0, 13},
+          {"png-filter", required_argument,   0, 14},
+          {"png-threads", required_argument,  0, 15},
+          {"frames",  required_argument,      0, 16},
+          {"camera-path", required_argument,  0, 17},
+          {"workers", required_argument,      0, 18},
+          {"worker-command", required_argument, 0, 19},
+          {"worker",  no_argument,            0, 20},
+          {"region",  required_argument,      0, 21},
           {0, 0, 0, 0}
         };
       /* `getopt_long' stores the option index here. */
       int option_index = 0;
       int c;
 
-      c = getopt_long (argc, argv, "f:o:h:s:S:w:",
+      c = getopt_long (argc, argv, "a:f:o:h:s:S:t:w:",
                        long_options, &option_index);
 
       /* Detect the end of the options. */
@@ -150,6 +876,15 @@ Scene::render (const Ray3D &camera_dir, int argc, char **argv,
 
 	  break;
 
+        case 't':
+          if ((options.threads = parse_num (optarg)) == -1)
+	    {
+	      std::cerr << "Wrong syntax for --threads option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+          break;
+
         case 'w':
           if ((width = parse_num (optarg)) == -1)
 	    {
@@ -172,6 +907,163 @@ Scene::render (const Ray3D &camera_dir, int argc, char **argv,
 	  usage (argv[0], 0);
 	  break;
 
+        case 2:
+	  bench = true;
+	  bench_sizes = optarg;
+	  break;
+
+        case 3:
+          if ((warmup = parse_num (optarg)) == -1)
+	    {
+	      std::cerr << "Wrong syntax for --warmup option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 4:
+          if ((repeat = parse_num (optarg)) <= 0)
+	    {
+	      std::cerr << "Wrong syntax for --repeat option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 5:
+	  stats = true;
+	  break;
+
+        case 'a':
+          if ((options.aa_depth = parse_num (optarg)) == -1)
+	    {
+	      std::cerr << "Wrong syntax for --aa-depth option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 6:
+          if ((options.aa_threshold = parse_real (optarg)) < 0)
+	    {
+	      std::cerr << "Wrong syntax for --aa-threshold option"
+			<< std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 7:
+          if ((options.min_contribution = parse_real (optarg)) < 0)
+	    {
+	      std::cerr << "Wrong syntax for --min-contribution option"
+			<< std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 8:
+          if ((options.roulette = parse_real (optarg)) < 0)
+	    {
+	      std::cerr << "Wrong syntax for --roulette option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 9:
+	  options.wavefront = true;
+	  break;
+
+        case 10:
+	  stream = true;
+	  break;
+
+        case 12:
+	  resume = true;
+	  /* Fall through.  */
+
+        case 11:
+	  mapped = true;
+	  break;
+
+        case 13:
+          if ((png_options.level = parse_num (optarg)) == -1
+	      || png_options.level > 9)
+	    {
+	      std::cerr << "Wrong syntax for --png-level option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 14:
+          if ((png_options.filter = parse_png_filter (optarg)) == -2)
+	    {
+	      std::cerr << "Wrong syntax for --png-filter option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 15:
+          if ((png_options.threads = parse_num (optarg)) == -1)
+	    {
+	      std::cerr << "Wrong syntax for --png-threads option"
+			<< std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 16:
+          if ((frames = parse_num (optarg)) <= 0)
+	    {
+	      std::cerr << "Wrong syntax for --frames option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 17:
+	  camera_path = optarg;
+	  break;
+
+        case 18:
+          if ((workers.local = parse_num (optarg)) == -1)
+	    {
+	      std::cerr << "Wrong syntax for --workers option" << std::endl;
+	      usage (argv[0], 1);
+	    }
+
+	  break;
+
+        case 19:
+	  workers.commands.push_back (optarg);
+	  break;
+
+        case 20:
+	  worker = true;
+	  break;
+
+        case 21:
+	  {
+	    std::istringstream iss (optarg);
+	    char c1, c2, c3;
+	    if (!(iss >> region.x >> c1 >> region.y >> c2
+		  >> region_width >> c3 >> region_height)
+		|| c1 != ',' || c2 != ',' || c3 != ','
+		|| region.x < 0 || region.y < 0
+		|| region_width <= 0 || region_height <= 0)
+	      {
+		std::cerr << "Wrong syntax for --region option" << std::endl;
+		usage (argv[0], 1);
+	      }
+	  }
+
+	  break;
+
         case '?':
           /* `getopt_long' already printed an error message. */
 	  usage (argv[0], 1);
@@ -190,118 +1082,737 @@ Scene::render (const Ray3D &camera_dir, int argc, char **argv,
   if (height == -1)
     height = (int) (width * (real) default_height / default_width);
 
-  Image i;
-  i.set_size (width, height);
+  if (worker)
+    std::exit (work (0, 1) ? 0 : 1);
+
+  if (png_options.threads == -1)
+    png_options.threads = options.threads;
+
   randf.set_seed (28111979L, seed);
+  options.seed = seed;
+  if (bench)
+    {
+      std::ostringstream oss;
+      if (!bench_sizes)
+	{
+	  oss << width / 2 << 'x' << height / 2 << ','
+	      << width << 'x' << height << ','
+	      << width * 2 << 'x' << height * 2;
+	}
+      else
+	oss << bench_sizes;
+
+      const char *name = std::strrchr (argv[0], '/');
+      name = name ? name + 1 : argv[0];
+      benchmark (camera_dir, name, oss.str ().c_str (), warmup, repeat,
+		 options);
+      return;
+    }
 
   if (!output_filename)
     output_filename = default_output_file;
 
-  render (camera_dir, i, max_ref);
+  if (region_width)
+    {
+      if (region.x + region_width > width || region.y + region_height > height)
+	{
+	  std::cerr << "--region must lie within the image" << std::endl;
+	  usage (argv[0], 1);
+	}
+      if (frames || camera_path || mapped || stream || !workers.empty ())
+	{
+	  std::cerr << "--region cannot be used together with --frames, "
+		    << "--camera-path, --mmap, --stream or --workers"
+		    << std::endl;
+	  usage (argv[0], 1);
+	}
+
+      region.full_width = width;
+      region.full_height = height;
+      Image i;
+      i.set_size (region_width, region_height);
+      render (camera_dir, width, height, region.x, region.y, i, options);
+      if (stats)
+	print_stats (std::cerr);
+
+      if (strcmp(output_filename, "-") == 0)
+	i.write (std::cout, output_format, png_options, region);
+      else
+	i.write (output_filename, output_format, png_options, region);
+      return;
+    }
+
+  if (frames || camera_path)
+    {
+      CameraPath path;
+      if (camera_path)
+	{
+	  std::ifstream is (camera_path);
+	  if (!is || !path.read (is) || path.empty ())
+	    {
+	      std::cerr << "Cannot read camera path from " << camera_path
+			<< std::endl;
+	      std::exit (1);
+	    }
+	}
+      else
+	path = CameraPath::turntable (camera_dir);
+
+      // By default, render one frame per keyframe.
+      if (!frames)
+	frames = path.size ();
+
+      render (path, frames, width, height, output_filename, output_format,
+	      png_options, options);
+      if (stats)
+	print_stats (std::cerr);
+      return;
+    }
+
+  if (mapped)
+    {
+      MappedImage i;
+      if (output_format != OUT_PPM || strcmp (output_filename, "-") == 0)
+	{
+	  std::cerr << "--mmap and --resume need a PPM output file"
+		    << std::endl;
+	  usage (argv[0], 1);
+	}
+      if (!i.open (output_filename, width, height, resume))
+	{
+	  std::cerr << "Cannot map " << output_filename << std::endl;
+	  std::exit (1);
+	}
+
+      render (camera_dir, i, options);
+      if (stats)
+	print_stats (std::cerr);
+      return;
+    }
+
+  if (stream)
+    {
+      std::ofstream os;
+      bool to_stdout = strcmp (output_filename, "-") == 0;
+      if (!to_stdout)
+	os.open (output_filename, std::ofstream::binary);
+
+      ImageWriter out (to_stdout ? std::cout : os, output_format,
+		       png_options);
+      render (camera_dir, width, height, out, options);
+      if (stats)
+	print_stats (std::cerr);
+      return;
+    }
+
+  Image i;
+  i.set_size (width, height);
+
+  // Workers need the arguments that are not options, for example
+  // the name of a scene file.
+  workers.program = argv[0];
+  workers.args.assign (argv + optind, argv + argc);
+  if (workers.empty ())
+    render (camera_dir, i, options);
+  else
+    render (camera_dir, i, options, workers);
+  if (stats)
+    print_stats (std::cerr);
+
   if (strcmp(output_filename, "-") == 0)
-    i.write (std::cout, output_format);
+    i.write (std::cout, output_format, png_options);
   else
-    i.write (output_filename, output_format);
+    i.write (output_filename, output_format, png_options);
 }
 
-bool Scene::compute_intersection (Intersection &i) const
+// Render the scene at each of the comma-separated WIDTHxHEIGHT SIZES,
+// WARMUP times without looking at the clock and then REPEAT times,
+// and print the fastest and average times and the resulting rates as
+// a JSON object on standard output.
+void
+Scene::benchmark (const Ray3D &camera, const char *name, const char *sizes,
+		  int warmup, int repeat, const RenderOptions &options) const
 {
-  bool had_intersection = false;
-  for (object_iterator oi = objects.begin (); oi != objects.end (); oi++)
+  int threads = options.threads;
+  std::cout << "{\"scene\": \"" << name << "\", "
+	    << "\"real\": \"" << (sizeof (real) == 4 ? "float" : "double")
+	    << "\", \"packet_size\": " << RayPacket::size << ", "
+	    << "\"flags\": \"" << BUILD_FLAGS << "\", "
+	    << "\"threads\": " << (threads > 0 ? threads : num_processors ())
+	    << ", \"aa_depth\": " << options.aa_depth
+	    << ", \"wavefront\": " << (options.wavefront ? "true" : "false")
+	    << ", \"runs\": [";
+
+  std::istringstream iss (sizes);
+  for (int n = 0; ; n++)
     {
-      const Object &o = *oi;
-      had_intersection |= o.intersect (i);
+      int w, h;
+      char x;
+      if (!(iss >> w >> x >> h) || x != 'x' || w < 2 || h < 2)
+	{
+	  std::cerr << "Wrong syntax for --bench option" << std::endl;
+	  std::exit (1);
+	}
+
+      Image m;
+      m.set_size (w, h);
+      for (int k = 0; k < warmup; k++)
+	render (camera, m, options);
+
+      double best = 0.0, total = 0.0;
+      for (int k = 0; k < repeat; k++)
+	{
+	  render (camera, m, options);
+	  if (k == 0 || last_stats.seconds < best)
+	    best = last_stats.seconds;
+	  total += last_stats.seconds;
+	}
+
+      // The counts are the same for every repetition.
+      const RenderStats &s = last_stats;
+      std::cout << (n ? ",\n  " : "\n  ")
+		<< "{\"width\": " << w << ", \"height\": " << h
+		<< ", \"repeat\": " << repeat
+		<< ", \"seconds_min\": " << best
+		<< ", \"seconds_mean\": " << total / repeat
+		<< ", \"pixels_per_second\": " << s.pixels / best
+		<< ", \"rays_per_second\": " << s.rays () / best
+		<< ", \"primary_rays_per_second\": " << s.primary_rays / best
+		<< ", \"shadow_rays_per_second\": " << s.shadow_rays / best
+		<< ", \"secondary_rays_per_second\": "
+		<< s.secondary_rays / best << "}";
+
+      if (!(iss >> x))
+	break;
+      if (x != ',')
+	{
+	  std::cerr << "Wrong syntax for --bench option" << std::endl;
+	  std::exit (1);
+	}
     }
 
-  return had_intersection;
+  std::cout << "]}" << std::endl;
+}
+
+// Print the counts for the last render on OS.
+void Scene::print_stats (std::ostream &os) const
+{
+  const RenderStats &s = last_stats;
+  os << "pixels: " << s.pixels << "\n"
+     << "primary rays: " << s.primary_rays << "\n"
+     << "shadow rays: " << s.shadow_rays << "\n"
+     << "secondary rays: " << s.secondary_rays << "\n"
+     << "seconds: " << s.seconds << "\n";
+
+#ifdef ENABLE_STATS
+  last_trace_stats.print (os);
+#else
+  os << "(configure with --enable-stats for more counters)\n";
+#endif
 }
 
-bool Scene::find_an_intersection (NormRay3D &r) const
+void Scene::prepare () const
 {
-  Intersection i (r);
+  if (prepared)
+    return;
+
+  bounded_objects.clear ();
+  unbounded_objects.clear ();
+  plane_objects.clear ();
+  planes.clear ();
+
+  compiled_lights.clear ();
+  for (light_iterator li = lights.begin (); li != lights.end (); li++)
+    {
+      CompiledLight cl;
+      cl.l = *li;
+      cl.kind = get_light_kind (**li);
+      compiled_lights.push_back (cl);
+    }
+
+  // The boxes are only needed to build the BVH.
+  std::vector<Bounds> boxes;
   for (object_iterator oi = objects.begin (); oi != objects.end (); oi++)
     {
       const Object &o = *oi;
-      if (o.intersect (i))
+      Bounds b = o.e.get_surface_bounds ();
+      if (b.is_finite ())
+	{
+	  bounded_objects.push_back (&o);
+	  if (!have_prebuilt)
+	    boxes.push_back (b);
+	}
+      else if (typeid (o.e) == typeid (Plane))
+	{
+	  plane_objects.push_back (&o);
+	  planes.add (static_cast <const Plane &> (o.e));
+	}
+      else
+	unbounded_objects.push_back (&o);
+    }
+
+  if (have_prebuilt && prebuilt.n_prims == (int) bounded_objects.size ())
+    {
+      bvh.use (prebuilt.nodes, prebuilt.n_nodes, prebuilt.prims,
+	       prebuilt.n_prims);
+      spheres.use (prebuilt.cx, prebuilt.cy, prebuilt.cz, prebuilt.r2,
+		   prebuilt.n_prims);
+      sphere_flags.clear ();
+      is_sphere = prebuilt.is_sphere;
+      prepared = true;
+      return;
+    }
+
+  if (have_prebuilt)
+    {
+      for (object_iterator oi = objects.begin (); oi != objects.end (); oi++)
+	{
+	  Bounds b = oi->e.get_surface_bounds ();
+	  if (b.is_finite ())
+	    boxes.push_back (b);
+	}
+    }
+
+  // Leaves hold at most as many objects as there are lanes in the
+  // sphere kernel, and the spheres are copied in the order of the
+  // leaves so that each leaf is tested at once.
+  bvh.build (boxes, SphereArray::lanes);
+
+  int n = bvh.prim_count;
+  spheres.resize (n);
+  sphere_flags.assign (n + 1, false);
+  for (int k = 0; k < n; k++)
+    {
+      const Entity &e = bounded_objects[bvh.prims[k]]->e;
+      if (typeid (e) == typeid (Sphere))
+	{
+	  spheres.set (k, static_cast <const Sphere &> (e));
+	  sphere_flags[k] = true;
+	}
+    }
+
+  is_sphere = &sphere_flags[0];
+  prepared = true;
+}
+
+void Scene::get_prepared (PreparedScene &p) const
+{
+  prepare ();
+  p.nodes = bvh.node_data;
+  p.n_nodes = bvh.node_count;
+  p.prims = bvh.prim_data;
+  p.n_prims = bvh.prim_count;
+  p.cx = spheres.get_x ();
+  p.cy = spheres.get_y ();
+  p.cz = spheres.get_z ();
+  p.r2 = spheres.get_r2 ();
+  p.is_sphere = is_sphere;
+}
+
+// Leaf visitors for BVH::traverse.  The spheres are tested with
+// SphereArray, the other objects one by one.
+struct Scene::ClosestHit {
+  const Scene &scene;
+  Intersection &i;
+
+  ClosestHit (const Scene &scene_, Intersection &i_) :
+    scene (scene_), i (i_) {}
+
+  real limit () const { return i.t; }
+  bool operator () (const int *prims, int n) {
+    const int *base = scene.bvh.prim_data;
+    int first = prims - base;
+
+    bool from_inside;
+    int hit = scene.spheres.closest (i.r, first, n, i.t, from_inside);
+    if (hit != -1)
+      {
+	const Object *o = scene.bounded_objects[base[hit]];
+	i.entity = &o->e;
+	i.object = o;
+	i.from_inside = from_inside;
+	i.kind = ENTITY_SPHERE;
+      }
+
+    bool had_intersection = hit != -1;
+    for (int k = 0; k < n; k++)
+      if (!scene.is_sphere[first + k]
+	  && scene.bounded_objects[prims[k]]->intersect (i))
+	{
+	  i.kind = ENTITY_OTHER;
+	  had_intersection = true;
+	}
+
+    return had_intersection;
+  }
+};
+
+struct Scene::AnyOccluder {
+  const Scene &scene;
+  const NormRay3D &r;
+  real tmax;
+  const Object *occluder;
+
+  AnyOccluder (const Scene &scene_, const NormRay3D &r_, real tmax_) :
+    scene (scene_), r (r_), tmax (tmax_), occluder (NULL) {}
+
+  real limit () const { return tmax; }
+  bool operator () (const int *prims, int n) {
+    const int *base = scene.bvh.prim_data;
+    int first = prims - base;
+
+    int hit = scene.spheres.any (r, first, n, tmax);
+    if (hit != -1)
+      {
+	occluder = scene.bounded_objects[base[hit]];
 	return true;
+      }
+
+    for (int k = 0; k < n; k++)
+      if (!scene.is_sphere[first + k]
+	  && scene.bounded_objects[prims[k]]->occludes (r, tmax))
+	{
+	  occluder = scene.bounded_objects[prims[k]];
+	  return true;
+	}
+
+    return false;
+  }
+};
+
+struct Scene::ClosestHits {
+  const Scene &scene;
+  RayPacket &p;
+
+  ClosestHits (const Scene &scene_, RayPacket &p_) : scene (scene_), p (p_) {}
+
+  void operator () (const int *prims, int n, PacketMask mask) {
+    int first = prims - scene.bvh.prim_data;
+    for (int k = 0; k < n; k++)
+      {
+	const Object &o = *scene.bounded_objects[prims[k]];
+	if (scene.is_sphere[first + k])
+	  {
+	    const Sphere &s = static_cast <const Sphere &> (o.e);
+	    p.set_kind (s.Sphere::intersect (p, mask, o), ENTITY_SPHERE);
+	  }
+	else
+	  p.set_kind (o.intersect (p, mask), ENTITY_OTHER);
+      }
+  }
+};
+
+bool Scene::compute_intersection (Intersection &i) const
+{
+  int hit = planes.closest (i.r, i.t);
+  if (hit != -1)
+    {
+      const Object *o = plane_objects[hit];
+      i.entity = &o->e;
+      i.object = o;
+      i.from_inside = false;
+      i.kind = ENTITY_PLANE;
     }
 
-  return false;
+  bool had_intersection = hit != -1;
+  for (size_t k = 0; k < unbounded_objects.size (); k++)
+    if (unbounded_objects[k]->intersect (i))
+      {
+	i.kind = ENTITY_OTHER;
+	had_intersection = true;
+      }
+
+  ClosestHit leaf (*this, i);
+  had_intersection |= bvh.traverse (i.r, leaf);
+  return had_intersection;
 }
 
-Color Scene::trace (const Ray3D &ray, int max_ref, real ior, Color strength,
-		    real absorbance) const
+void Scene::compute_intersection (RayPacket &p, PacketMask active) const
 {
-  Intersection i (ray);
-  Color c (0.0, 0.0, 0.0);
-  if (!compute_intersection (i))
-    return c;
+  for (size_t k = 0; k < plane_objects.size (); k++)
+    {
+      const Object &o = *plane_objects[k];
+      const Plane &pl = static_cast <const Plane &> (o.e);
+      p.set_kind (pl.Plane::intersect (p, active, o), ENTITY_PLANE);
+    }
+
+  for (size_t k = 0; k < unbounded_objects.size (); k++)
+    p.set_kind (unbounded_objects[k]->intersect (p, active), ENTITY_OTHER);
 
-  Point3D p = i.r (i.t);
+  ClosestHits leaf (*this, p);
+  bvh.traverse (p, active, leaf);
+}
 
-  if (absorbance != 0.0)
-    strength *= exp (-i.t * absorbance);
+// Return whether something blocks R before it travels TMAX, i.e.
+// whether the point that R starts from is in the shadow of LIGHT.
+bool Scene::occluded (TraceState &state, int light, const NormRay3D &r,
+		      real tmax) const
+{
+  state.stats.shadow_rays++;
+  const Object *&last = state.last_occluder[light];
+  if (last && last->occludes (r, tmax))
+    return true;
 
-  bool have_shadows = i.object->have_shadows;
-  const Entity &e = *(i.entity);
-  const Material &m = i.object->m;
-  const Texture &t = i.object->t;
+  int hit = planes.any (r, tmax);
+  if (hit != -1)
+    {
+      last = plane_objects[hit];
+      return true;
+    }
 
-  UnitVector3D normal = i.from_inside ? -e.get_normal (i) : e.get_normal (i);
-  Color obj_color = t.get_color (p, e) * strength;
+  for (size_t k = 0; k < unbounded_objects.size (); k++)
+    if (unbounded_objects[k]->occludes (r, tmax))
+      {
+	last = unbounded_objects[k];
+	return true;
+      }
 
-  c += (ambient + m.ambient) * obj_color;
+  AnyOccluder leaf (*this, r, tmax);
+  if (!bvh.traverse (r, leaf, true))
+    return false;
 
-  for (light_iterator li = lights.begin (); li != lights.end (); li++)
+  last = leaf.occluder;
+  return true;
+}
+
+// The following functions call directly the member functions of the
+// entities, textures and lights whose type was recognized by prepare ()
+// or by compute_intersection, and go through the vtable for the others.
+
+static inline UnitVector3D get_normal (const Intersection &i, const Point3D &p)
+{
+  switch (i.kind)
+    {
+    case ENTITY_SPHERE:
+      return static_cast <const Sphere *> (i.entity)->Sphere::get_normal (p);
+    case ENTITY_PLANE:
+      return static_cast <const Plane *> (i.entity)->Plane::get_normal (p);
+    default:
+      return i.entity->get_normal (i);
+    }
+}
+
+static inline real texture_u (const Intersection &i, const Point3D &p)
+{
+  switch (i.kind)
+    {
+    case ENTITY_SPHERE:
+      return static_cast <const Sphere *> (i.entity)->Sphere::texture_u (p);
+    case ENTITY_PLANE:
+      return static_cast <const Plane *> (i.entity)->Plane::texture_u (p);
+    default:
+      return i.entity->texture_u (i);
+    }
+}
+
+static inline real texture_v (const Intersection &i, const Point3D &p)
+{
+  switch (i.kind)
     {
-      const AbstractLight &l = **li;
-      UnitVector3D to_light = (l.get_pos () - p).normalize ();
-      Color light_color = strength * l.get_color (p);
+    case ENTITY_SPHERE:
+      return static_cast <const Sphere *> (i.entity)->Sphere::texture_v (p);
+    case ENTITY_PLANE:
+      return static_cast <const Plane *> (i.entity)->Plane::texture_v (p);
+    default:
+      return i.entity->texture_v (i);
+    }
+}
 
-      if (have_shadows && l.cast_shadows)
+static inline Color get_color (const Object &o, const Intersection &i,
+			       const Point3D &p)
+{
+  switch (o.tkind)
+    {
+    case TEXTURE_MONO:
+      return static_cast <const MonoTexture &> (o.t).pigment;
+    case TEXTURE_CHECKER:
+      {
+	real u = texture_u (i, p);
+	real v = texture_v (i, p);
+	const CheckerTexture &t = static_cast <const CheckerTexture &> (o.t);
+	return t.CheckerTexture::get_color (u, v);
+      }
+    default:
+      return o.t.get_color (i, p);
+    }
+}
+
+// Return whether to trace a secondary ray whose color will be weighted
+// by STRENGTH, which is scaled up if the ray survives Russian roulette.
+inline bool Scene::follow (TraceState &state, Color &strength) const
+{
+  real w = std::max (strength.r, std::max (strength.g, strength.b));
+  if (state.roulette == 0.0)
+    return w >= state.min_contribution;
+
+  if (w >= state.roulette)
+    return true;
+
+  // Survive with probability W / ROULETTE; then the expected value
+  // of the contribution is unchanged if STRENGTH is divided by it.
+  real p = w / state.roulette;
+  if (w <= 0.0 || state.random () >= p)
+    return false;
+
+  strength = Color (strength.r / p, strength.g / p, strength.b / p);
+  return true;
+}
+
+// Compute the color of the point where RAY hits the scene, as found
+// by compute_intersection and stored in I.  The reflected and refracted
+// rays are traced depth-first, using STATE.FRAMES as a stack instead of
+// recursion; each child's color is added to its parent's as soon as it
+// is known, in the same order as a recursive tracer would do.
+Color Scene::shade (TraceState &state, const Ray3D &ray, const Intersection &i,
+		    int max_ref, real ior, Color strength,
+		    real absorbance) const
+{
+  std::vector<Frame> &frames = state.frames;
+  size_t base = frames.size ();
+
+  PendingRay r = { ray, max_ref, ior, strength, absorbance };
+  frames.push_back (Frame ());
+  STATS_DEPTH (0);
+  shade_hit (state, r, i, frames.back ());
+
+  for (;;)
+    {
+      Frame &f = frames.back ();
+      if (f.done < f.n_next)
 	{
-	  NormRay3D shadow_ray (p, to_light, 0.0001);
-	  if (find_an_intersection (shadow_ray))
-	    continue;
+	  // F is invalid after push_back, so copy the ray.
+	  PendingRay next = f.next[f.done++];
+	  Intersection ni (next.ray);
+	  if (compute_intersection (ni))
+	    {
+	      frames.push_back (Frame ());
+	      STATS_DEPTH (frames.size () - 1 - base);
+	      shade_hit (state, next, ni, frames.back ());
+	    }
 	}
-
-      // Diffuse light
-      if (m.diffuse > 0)
+      else
 	{
-	  real cosine = to_light * normal;
-	  if (cosine > 0.0)
-	    c += (m.diffuse - ambient) * cosine * obj_color * light_color;
+	  Color c = f.c;
+	  frames.pop_back ();
+	  if (frames.size () == base)
+	    return c;
+	  frames.back ().c += c;
 	}
-      
-      // Specular highlights
-      if (m.specular > 0)
+    }
+}
+
+// Fill SP for the point where R.RAY hits the scene, as found by
+// compute_intersection and stored in I, and return the ambient light
+// of the point.
+Color Scene::surface (const PendingRay &r, const Intersection &i,
+		      SurfacePoint &sp) const
+{
+  sp.p = i.r (i.t);
+  sp.strength = r.strength;
+  if (r.absorbance != 0.0)
+    sp.strength *= exp (-i.t * r.absorbance);
+
+  sp.normal = get_normal (i, sp.p);
+  if (i.from_inside)
+    sp.normal = -sp.normal;
+
+  sp.obj_color = get_color (*i.object, i, sp.p) * sp.strength;
+  return (ambient + i.object->m.ambient) * sp.obj_color;
+}
+
+// Return the direction from SP to LIGHT, and store the distance in
+// DIST and the color of the light, times the strength of the ray, in
+// COLOR.
+UnitVector3D Scene::to_light (const SurfacePoint &sp, int light, real &dist,
+			      Color &color) const
+{
+  const AbstractLight &l = *compiled_lights[light].l;
+  Vector3D light_vec;
+  if (compiled_lights[light].kind == LIGHT_POINT)
+    {
+      const Light &pl = static_cast <const Light &> (l);
+      light_vec = pl.pos - sp.p;
+      color = sp.strength * pl.color;
+    }
+  else
+    {
+      light_vec = l.get_pos () - sp.p;
+      color = sp.strength * l.get_color (sp.p);
+    }
+
+  dist = light_vec.length ();
+  return UnitVector3D (light_vec / dist);
+}
+
+// Compute the diffuse light and the specular highlight that a light
+// in direction DIR and with color LIGHT_COLOR adds to SP, as seen along
+// RAY.  Either can be black.
+void Scene::light_terms (const Ray3D &ray, const Material &m,
+			 const SurfacePoint &sp, const UnitVector3D &dir,
+			 const Color &light_color, Color &diffuse,
+			 Color &specular) const
+{
+  diffuse = specular = Color (0.0, 0.0, 0.0);
+
+  // Diffuse light
+  if (m.diffuse > 0)
+    {
+      real cosine = dir * sp.normal;
+      if (cosine > 0.0)
+	diffuse = (m.diffuse - ambient) * cosine * sp.obj_color * light_color;
+    }
+
+  // Specular highlights
+  if (m.specular > 0)
+    {
+      Vector3D v = 2 * (dir * sp.normal) * sp.normal - dir;
+      real cosine = -ray.dir * v.normalize ();
+      if (cosine > 0.0)
 	{
-	  Vector3D specular = 2 * (to_light * normal) * normal - to_light;
-	  real cosine = -ray.dir * specular.normalize ();
-          if (cosine > 0.0)
-	    {
-	      cosine = std::pow (cosine, m.reflectivity);
-	      c += m.specular * cosine * light_color;
-	    }
+	  cosine = std::pow (cosine, m.reflectivity);
+	  specular = m.specular * cosine * light_color;
 	}
     }
+}
+
+// Store in F.NEXT the reflected and refracted rays of R at SP, which
+// is where R hits the scene according to I.
+void Scene::secondary (TraceState &state, const PendingRay &r,
+		       const Intersection &i, const SurfacePoint &sp,
+		       Frame &f) const
+{
+  const Ray3D &ray = r.ray;
+  const Material &m = i.object->m;
+  const Point3D &p = sp.p;
+  const UnitVector3D &normal = sp.normal;
+
+  f.n_next = f.done = 0;
 
   // reflections...
+  int max_ref = r.max_ref;
   if (m.max_ref < max_ref)
     max_ref = m.max_ref;
 
-  if (m.reflective > 0 && max_ref > 0)
+  Color reflected_strength = sp.strength * m.reflective;
+  if (m.reflective > 0 && max_ref > 0 && follow (state, reflected_strength))
     {
       Vector3D reflected = ray.dir - 2 * (ray.dir * normal) * normal;
-      Ray3D reflected_ray = Ray3D (p, reflected, 0.0001);
-      c += trace (reflected_ray, max_ref - 1, ior, strength * m.reflective);
+      PendingRay &next = f.next[f.n_next++];
+      next.ray = Ray3D (p, reflected, 0.0001);
+      next.max_ref = max_ref - 1;
+      next.ior = r.ior;
+      next.strength = reflected_strength;
+      next.absorbance = 0.0;
+      state.stats.secondary_rays++;
+      STATS_INC (reflected_rays);
     }
 
   // refractions...
-  if (m.refractive > 0 && max_ref > 0)
+  Color refracted_strength = sp.strength * m.refractive;
+  if (m.refractive > 0 && max_ref > 0 && follow (state, refracted_strength))
     {
       // Relative index of refraction
-      real n = ior / m.ior;
+      real n = r.ior / m.ior;
       real cosI = -normal * ray.dir;
       real sinI2 = 1.0 - cosI * cosI;
       real sinT2 = (n * n) * sinI2;
@@ -310,13 +1821,50 @@ Color Scene::trace (const Ray3D &ray, int max_ref, real ior, Color strength,
 	{
 	  real cosT = sqrt (cosT2);
 	  Vector3D refracted = n * ray.dir + (n * cosI - cosT) * normal;
-          Ray3D refracted_ray = Ray3D (p, refracted, 0.01);
-          c += trace (refracted_ray, max_ref - 1, m.ior,
-		      strength * m.refractive,
-		      i.from_inside ? absorbance + m.absorbance
-				    : absorbance - m.absorbance);
+	  PendingRay &next = f.next[f.n_next++];
+	  next.ray = Ray3D (p, refracted, 0.01);
+	  next.max_ref = max_ref - 1;
+	  next.ior = m.ior;
+	  next.strength = refracted_strength;
+	  next.absorbance = i.from_inside ? r.absorbance + m.absorbance
+					  : r.absorbance - m.absorbance;
+	  state.stats.secondary_rays++;
+	  STATS_INC (refracted_rays);
 	}
     }
+}
+
+// Compute in F the color of the point where R.RAY hits the scene, as
+// found by compute_intersection and stored in I, without reflections
+// and refractions.  Store the reflected and refracted rays in F.NEXT.
+void Scene::shade_hit (TraceState &state, const PendingRay &r,
+		       const Intersection &i, Frame &f) const
+{
+  SurfacePoint sp;
+  Color c (0.0, 0.0, 0.0);
+  c += surface (r, i, sp);
+
+  bool have_shadows = i.object->have_shadows;
+  const Material &m = i.object->m;
+  int n_lights = compiled_lights.size ();
+  for (int light = 0; light < n_lights; light++)
+    {
+      real dist;
+      Color light_color;
+      UnitVector3D dir = to_light (sp, light, dist, light_color);
+      if (have_shadows && compiled_lights[light].l->cast_shadows)
+	{
+	  NormRay3D shadow_ray (sp.p, dir, 0.0001);
+	  if (occluded (state, light, shadow_ray, dist - 0.0001))
+	    continue;
+	}
+
+      Color diffuse, specular;
+      light_terms (r.ray, m, sp, dir, light_color, diffuse, specular);
+      c += diffuse;
+      c += specular;
+    }
 
-  return c;
+  f.c = c;
+  secondary (state, r, i, sp, f);
 }
@@ -9,12 +9,14 @@
 #include "light.h"
 #include "texture.h"
 #include "images.h"
+#include "camera.h"
+#include "bvh.h"
+#include "prims.h"
+#include "arena.h"
+#include "stats.h"
+#include "rand.h"
 
-#ifdef HAVE_SLIST
-#include <ext/slist>
-#else
-#include <list>
-#endif
+#include <vector>
 
 struct Material {
   real ambient;
@@ -44,36 +46,289 @@ struct Object {
   const Material &m;
   const Texture &t;
   bool have_shadows;
+  texture_kind tkind;
 
   Object (const Entity &e_, const Material &m_, const Texture &t_,
-    bool shadows = true) : e (e_), m (m_), t (t_), have_shadows (shadows) {}
+    bool shadows = true) : e (e_), m (m_), t (t_), have_shadows (shadows),
+    tkind (get_texture_kind (t_)) {}
 
   bool intersect (Intersection &i) const { return e.intersect (i, *this); }
+  PacketMask intersect (RayPacket &p, PacketMask active) const {
+    return e.intersect (p, active, *this);
+  }
+  bool occludes (const NormRay3D &r, real tmax) const {
+    return e.occludes (r, *this, tmax);
+  }
+};
+
+// Settings for Scene::render.
+struct RenderOptions {
+  int max_ref;		// maximum depth of reflections and refractions
+  int threads;		// rendering threads, 0 means one per processor
+
+  // Pixels whose corners differ are split in four, recursively, up to
+  // AA_DEPTH times; zero traces one ray through the center of each pixel.
+  // Corners differ if they hit different objects or if one component
+  // of their colors differs by more than AA_THRESHOLD.
+  int aa_depth;
+  real aa_threshold;
+
+  // Reflected and refracted rays whose contribution to the pixel is
+  // below MIN_CONTRIBUTION for every component are not traced.  If
+  // ROULETTE is nonzero, rays below ROULETTE are instead traced with
+  // probability proportional to their contribution, which is scaled
+  // up accordingly; this is unbiased, but adds noise that depends on
+  // SEED.
+  real min_contribution;
+  real roulette;
+  unsigned long seed;
+
+  // Trace the rays of each tile in waves, one generation at a time,
+  // instead of following each ray down to its last reflection.
+  bool wavefront;
+
+  RenderOptions (int max_ref_ = 5, int threads_ = 0) :
+    max_ref (max_ref_), threads (threads_), aa_depth (0), aa_threshold (0.1),
+    min_contribution (1.0 / 1024), roulette (0), seed (17031980L),
+    wavefront (false) {}
+};
+
+// Worker processes for Scene::render.  LOCAL workers run PROGRAM with
+// ARGS and --worker; each of COMMANDS is run by the shell and must
+// start a worker whose standard input and output are those of the
+// command, for example "ssh host ./scene1 --worker".
+struct WorkerOptions {
+  const char *program;
+  std::vector<const char *> args;
+  int local;
+  std::vector<const char *> commands;
+
+  WorkerOptions () : program (NULL), local (0) {}
+  bool empty () const { return local == 0 && commands.empty (); }
+};
+
+// Counts of the work done by Scene::render.
+struct RenderStats {
+  long pixels;
+  long primary_rays;
+  long shadow_rays;
+  long secondary_rays;
+  double seconds;
+
+  RenderStats () :
+    pixels (0), primary_rays (0), shadow_rays (0), secondary_rays (0),
+    seconds (0.0) {}
+
+  long rays () const { return primary_rays + shadow_rays + secondary_rays; }
+
+  RenderStats &operator += (const RenderStats &s) {
+    pixels += s.pixels;
+    primary_rays += s.primary_rays;
+    shadow_rays += s.shadow_rays;
+    secondary_rays += s.secondary_rays;
+    seconds += s.seconds;
+    return *this;
+  }
+};
+
+// The acceleration structures that Scene::prepare builds, as plain
+// arrays that can be saved to a file and used again for a scene that
+// has the same objects, added in the same order.  The sphere arrays
+// have SphereArray::lanes extra elements at the end.
+struct PreparedScene {
+  const BVH::Node *nodes;
+  int n_nodes;
+  const int *prims;
+  int n_prims;
+  const real *cx, *cy, *cz, *r2;
+  const unsigned char *is_sphere;	// N_PRIMS flags
 };
 
 class Scene {
-#ifdef HAVE_SLIST
-  template <typename T> struct slist : std::slist<T> { };
-#else
-  template <typename T> struct slist : std::list<T> { };
-#endif
+  // Entities, materials, textures and lights passed to own ().
+  Arena arena;
+
+  std::vector<const AbstractLight *> lights;
+  std::vector<Object> objects;
+
+  typedef std::vector<const AbstractLight *>::const_iterator light_iterator;
+  typedef std::vector<Object>::const_iterator object_iterator;
+
+  // Objects whose surface has finite bounds, even if their inside does
+  // not (as for ReverseSphere), are found through the BVH, and those
+  // that are spheres are also copied to SPHERES in the order of the
+  // BVH's leaves.  Planes are kept in a PlaneArray, and the remaining
+  // objects are tested one by one.  All this is rebuilt by prepare ()
+  // whenever objects have been added.
+  mutable bool prepared;
+  mutable BVH bvh;
+  mutable std::vector<const Object *> bounded_objects;
+  mutable SphereArray spheres;
+  mutable std::vector<unsigned char> sphere_flags;
+  mutable const unsigned char *is_sphere;
+
+  // Structures given to use_prepared, if any.
+  PreparedScene prebuilt;
+  bool have_prebuilt;
+  mutable PlaneArray planes;
+  mutable std::vector<const Object *> plane_objects;
+  mutable std::vector<const Object *> unbounded_objects;
+
+  // The lights, with the kind of each.
+  struct CompiledLight {
+    const AbstractLight *l;
+    light_kind kind;
+  };
+
+  mutable std::vector<CompiledLight> compiled_lights;
+
+  mutable RenderStats last_stats;
+  mutable TraceStats last_trace_stats;
+
+  struct ClosestHit;
+  struct ClosestHits;
+  struct AnyOccluder;
+
+  struct RenderJob;
+  class RenderThread;
 
-  slist <const AbstractLight *> lights;
-  slist <Object> objects;
+  void run (RenderJob &job) const;
+  void render_rect (const Ray3D &camera, int w, int h, int x0, int y0,
+		    Image &m, const RenderOptions &options,
+		    bool progress = false) const;
 
-  typedef slist<const AbstractLight *>::const_iterator light_iterator;
-  typedef slist<Object>::const_iterator object_iterator;
+  // A ray waiting to be traced, with the arguments of shade ().
+  struct PendingRay {
+    Ray3D ray;
+    int max_ref;
+    real ior;
+    Color strength;
+    real absorbance;
+  };
+
+  // A hit whose reflected and refracted rays are being traced.
+  struct Frame {
+    Color c;			// color found so far
+    PendingRay next[2];		// reflected and refracted ray, if any
+    int n_next;			// number of rays in NEXT
+    int done;			// number of rays in NEXT already traced
+  };
+
+  // What shading needs to know about the point where a ray hits.
+  struct SurfacePoint {
+    Point3D p;
+    UnitVector3D normal;
+    Color strength;		// of the ray, after absorbance
+    Color obj_color;		// of the object, times STRENGTH
+  };
+
+  // A ray of a wave traced by trace_wave (), and the node that receives
+  // its color.
+  struct WaveRay {
+    PendingRay r;
+    int node;
+  };
+
+  // The color of a ray, and the nodes of its reflected and refracted
+  // rays.  The nodes of a wave come after those of the previous waves,
+  // so children always come after their parent.
+  struct WaveNode {
+    Color c;
+    int child[2];
+    int n_child;
+
+    WaveNode () : c (0.0, 0.0, 0.0), n_child (0) {}
+  };
+
+  // A shadow ray waiting to be tested, and the light term it affects.
+  struct ShadowRay {
+    NormRay3D r;
+    real tmax;
+    int term;
+  };
+
+  // Buffers for trace_wave (), kept between calls to avoid allocations.
+  struct WaveBuffers {
+    std::vector<WaveRay> wave, next;
+    std::vector<WaveNode> nodes;
+    std::vector<Intersection> hits;
+    std::vector<int> hit_ray, order;
+    std::vector<SurfacePoint> points;
+    std::vector<UnitVector3D> light_dirs;
+    std::vector<Color> light_colors;
+    std::vector<char> shadowed;
+    std::vector<std::vector<ShadowRay> > shadow_rays;
+  };
+
+  // Per-thread state of the tracer.
+  struct TraceState {
+    // For each light, the object that last blocked a shadow ray.  It is
+    // likely to block the next one too, so it is tested first.
+    std::vector<const Object *> last_occluder;
+
+    // The rays traced by this thread.
+    RenderStats stats;
+
+    // More detailed counters, see stats.h.
+    TraceStats trace_stats;
+
+    // Settings for pruning secondary rays, see RenderOptions.
+    real min_contribution;
+    real roulette;
+    rng random;
+
+    // The stack used by shade (), and the buffers of trace_wave ().
+    std::vector<Frame> frames;
+    WaveBuffers wave;
+
+    TraceState (const Scene &s, const RenderOptions &options, int index) :
+      last_occluder (s.lights.size ()),
+      min_contribution (options.min_contribution),
+      roulette (options.roulette),
+      random (28111979L + index, options.seed) {}
+  };
 
   bool compute_intersection (Intersection &i) const;
-  bool find_an_intersection (NormRay3D &r) const;
-  Color trace (const Ray3D &r, int max_ref, real ior,
-	       Color strength = colors::white, real absorbance = 0.0)
-    const;
+  void compute_intersection (RayPacket &p, PacketMask active) const;
+  bool follow (TraceState &state, Color &strength) const;
+  bool occluded (TraceState &state, int light, const NormRay3D &r,
+		 real tmax) const;
+  Color shade (TraceState &state, const Ray3D &r, const Intersection &i,
+	       int max_ref, real ior, Color strength = colors::white,
+	       real absorbance = 0.0) const;
+  void shade_hit (TraceState &state, const PendingRay &r,
+		  const Intersection &i, Frame &f) const;
+  Color surface (const PendingRay &r, const Intersection &i,
+		 SurfacePoint &sp) const;
+  UnitVector3D to_light (const SurfacePoint &sp, int light, real &dist,
+			 Color &color) const;
+  void light_terms (const Ray3D &ray, const Material &m,
+		    const SurfacePoint &sp, const UnitVector3D &dir,
+		    const Color &light_color, Color &diffuse,
+		    Color &specular) const;
+  void secondary (TraceState &state, const PendingRay &r,
+		  const Intersection &i, const SurfacePoint &sp,
+		  Frame &f) const;
+  void trace_wave (TraceState &state, const Ray3D *rays, int n, int max_ref,
+		   Color *out, const Object **hit) const;
+
+  void print_stats (std::ostream &os) const;
+  void benchmark (const Ray3D &camera, const char *name, const char *sizes,
+		  int warmup, int repeat, const RenderOptions &options) const;
 
  public:
   real ambient;
 
-  Scene (real ambient_ = 0.0) : lights (), objects (), ambient (ambient_) {}
+  Scene (real ambient_ = 0.0) :
+    lights (), objects (), prepared (false), is_sphere (NULL),
+    have_prebuilt (false), ambient (ambient_) {}
+
+  // Return a copy of X that lives as long as the scene, for example
+  // scene.add_object (scene.own (Sphere (0, 1, 0, 1)), m, t).  Objects
+  // added to the scene can also refer to data that the caller keeps
+  // alive, as long as it outlives the scene.
+  template <typename T>
+  const T &own (const T &x) { return *arena.make (x); }
 
   void add_light (const AbstractLight &l) {
     lights.push_back (&l);
@@ -81,21 +336,99 @@ class Scene {
 
   void add_object (const Entity &e, const Material &m, const Texture &t) {
     objects.push_back (Object (e, m, t));
+    prepared = false;
   }
 
-  void render (const Point3D &camera, Image &m, int max_ref = 5) const {
+  // Make room for N objects, to avoid copying them while adding.
+  void reserve_objects (int n) { objects.reserve (n); }
+  int get_object_count () const { return objects.size (); }
+
+  // Build the acceleration structures.  render () does this
+  // automatically, so there is usually no need to call it.
+  void prepare () const;
+
+  // Prepare the scene and store its acceleration structures in P; they
+  // are valid until the scene changes.
+  void get_prepared (PreparedScene &p) const;
+
+  // Make prepare () use P, which must stay valid as long as the scene,
+  // instead of building the structures.  If the objects do not match
+  // P, they are built as usual.
+  void use_prepared (const PreparedScene &p) {
+    prebuilt = p;
+    have_prebuilt = true;
+    prepared = false;
+  }
+
+  void render (const Point3D &camera, Image &m, int max_ref = 5,
+	       int threads = 0) const {
     Point3D dest (0, 0, 0);
     Ray3D camera_dir (camera, dest);
-    render (camera_dir, m, max_ref);
+    render (camera_dir, m, max_ref, threads);
   }
 
   void render (const Point3D &camera, const Vector3D &dir, Image &m,
-	       int max_ref = 5) const {
+	       int max_ref = 5, int threads = 0) const {
     Ray3D camera_dir (camera, dir);
-    render (camera_dir, m, max_ref);
+    render (camera_dir, m, max_ref, threads);
+  }
+
+  // Render the scene into M using THREADS threads (0 = one per processor).
+  void render (const Ray3D &camera, Image &m, int max_ref = 5,
+	       int threads = 0) const {
+    render (camera, m, RenderOptions (max_ref, threads));
   }
 
-  void render (const Ray3D &camera, Image &m, int max_ref = 5) const;
+  void render (const Ray3D &camera, Image &m,
+	       const RenderOptions &options) const;
+
+  // Render into M the pixels of a W x H image that start at (X0, Y0),
+  // using the projection of the whole image, so that the regions of an
+  // image can be rendered separately and then put back together.
+  void render (const Ray3D &camera, int w, int h, int x0, int y0, Image &m,
+	       const RenderOptions &options) const;
+
+  // Render a W x H image one strip of rows at a time and pass the rows
+  // to OUT as soon as each strip is complete.  Only two strips are kept
+  // in memory, and they are written out while the next one is rendered.
+  void render (const Ray3D &camera, int w, int h, ImageWriter &out,
+	       const RenderOptions &options) const;
+
+  // Render M, which is mapped to a file, one strip of rows at a time,
+  // skipping the rows that M says are already done and telling it after
+  // each strip.  This makes it possible to resume an interrupted render.
+  void render (const Ray3D &camera, MappedImage &m,
+	       const RenderOptions &options) const;
+
+  // Render N_FRAMES frames of W x H pixels, with the camera moving along
+  // PATH from its first to its last keyframe.  The frames are written
+  // in format FMT to files whose names are PATTERN with the frame number
+  // inserted (or printf'ed, if PATTERN has a % sign), or to standard
+  // output one after another if PATTERN is "-".  The acceleration
+  // structures are built once, and each frame is written while the next
+  // one is rendered.
+  void render (const CameraPath &path, int n_frames, int w, int h,
+	       const char *pattern, enum image_file_format fmt,
+	       const PngOptions &png_options,
+	       const RenderOptions &options) const;
+
+  // Render M with worker processes, each of which is given one tile at
+  // a time.  The tiles of a worker that fails are passed to the others,
+  // or rendered here if there is none left.
+  void render (const Ray3D &camera, Image &m, const RenderOptions &options,
+	       const WorkerOptions &workers) const;
+
+  // Serve the requests of a render with workers, reading them from
+  // file descriptor IN and writing the results to OUT.  Return false
+  // if there was an error.
+  bool work (int in, int out) const;
+
+  // Return the counts for the last call to render.
+  const RenderStats &get_stats () const { return last_stats; }
+
+  // Likewise for the counters in stats.h, which are all zero unless
+  // ENABLE_STATS is defined.
+  const TraceStats &get_trace_stats () const { return last_trace_stats; }
 
 #ifdef HAVE_LIBPNG
   void render (const Ray3D &camera, int argc, char **argv,
@@ -31,12 +31,9 @@ int main (int argc, char **argv)
 
   scene.add_light (l);
 
-  Sphere s[N];
+  scene.reserve_objects (N);
   for (int i = 0; i < N; i++)
-    {
-      s[i] = shell (i);
-      scene.add_object (s[i], plastic, coral);
-    }
+    scene.add_object (scene.own (shell (i)), plastic, coral);
 
   Point3D location (0, -7, -20);
   Vector3D direction (0, -0.1, 1);
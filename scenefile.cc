@@ -0,0 +1,1079 @@
+// Example ray tracing program
+// Scene description files
+
+#include "config.h"
+#include "scenefile.h"
+#include "scene.h"
+#include "mesh.h"
+#include "instance.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <stdint.h>
+
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+// A sphere added with an object statement, as stored in a scene cache.
+// MATERIAL and TEXTURE are indices in the order of definition, with the
+// predefined textures first.
+struct CachedSphere {
+  real x, y, z, r;
+  int32_t material, texture;
+};
+
+// An operand of a union statement, with the center of its surface.
+struct UnionItem {
+  const Entity *e;
+  Point3D center;
+};
+
+struct CenterLess {
+  int axis;
+  explicit CenterLess (int axis_) : axis (axis_) {}
+
+  bool operator () (const UnionItem &a, const UnionItem &b) const {
+    return axis == 0 ? a.center.x < b.center.x
+	   : axis == 1 ? a.center.y < b.center.y : a.center.z < b.center.z;
+  }
+};
+
+// Reads a scene file held in memory.  Words are not copied: each one
+// is a pointer into the buffer and a length.
+class SceneParser {
+  Scene &scene;
+  SceneSettings &settings;
+  const char *p, *end;
+  int line;
+
+  const char *word;
+  size_t word_len;
+
+  // The first error found; once there is one, nothing else is read.
+  std::string error;
+
+  std::map<std::string, const Entity *> entities;
+  std::map<std::string, int> materials, textures;
+  std::vector<const Material *> material_list;
+  std::vector<const Texture *> texture_list;
+
+  // The last material and texture looked up, since consecutive objects
+  // usually have the same ones, or -1.
+  std::string last_material_name, last_texture_name;
+  int last_material, last_texture;
+
+  // When compiling a scene cache, the spheres of object statements go
+  // to FLAT_SPHERES and all the other statements to REST.  The files
+  // read by mesh statements are listed in MESH_FILES, one per line
+  // after their size and modification time.
+  std::vector<CachedSphere> *flat_spheres;
+  std::string *rest, *mesh_files;
+
+  void skip_blanks ();
+  bool next ();
+  bool is (const char *keyword) const {
+    return word_len == strlen (keyword)
+	   && memcmp (word, keyword, word_len) == 0;
+  }
+  bool at_number ();
+  std::string name () const { return std::string (word, word_len); }
+
+  // Each of these records an error if the input is not valid, after
+  // which the ones that return a pointer return NULL.
+  void fail (const std::string &msg);
+  bool expect_word (const char *what);
+  real number ();
+  Color color ();
+  Point3D point ();
+  Vector3D vector ();
+  std::string new_name ();
+
+  const Entity *entity ();
+  bool transform (Transform &t);
+  const Entity *make_union (std::vector<UnionItem> &items, size_t first,
+			    size_t last);
+  const AbstractLight *light ();
+  int material ();
+  int texture ();
+
+  void define_texture (const std::string &n, const Texture *t);
+  void parse_material ();
+  void parse_texture ();
+  bool flat_sphere ();
+  void statement ();
+
+ public:
+  SceneParser (Scene &scene_, SceneSettings &settings_,
+	       const char *data, size_t size);
+
+  // Return false if there is an error, and store it in ERROR_MSG.
+  bool parse (std::string &error_msg);
+  int get_line () const { return line; }
+
+  // Make parse () store spheres in SPHERES and the text of the other
+  // statements in TEXT, instead of adding anything to the scene, and
+  // list the files of meshes in FILES.
+  void flatten (std::vector<CachedSphere> &spheres, std::string &text,
+		std::string &files) {
+    flat_spheres = &spheres;
+    rest = &text;
+    mesh_files = &files;
+  }
+
+  int n_materials () const { return material_list.size (); }
+  int n_textures () const { return texture_list.size (); }
+  const Material &get_material (int k) const { return *material_list[k]; }
+  const Texture &get_texture (int k) const { return *texture_list[k]; }
+};
+
+SceneParser::SceneParser (Scene &scene_, SceneSettings &settings_,
+			  const char *data, size_t size) :
+  scene (scene_), settings (settings_), p (data), end (data + size),
+  line (1), word (NULL), word_len (0), last_material (-1),
+  last_texture (-1), flat_spheres (NULL), rest (NULL), mesh_files (NULL)
+{
+  define_texture ("black", &MonoTexture::black);
+  define_texture ("white", &MonoTexture::white);
+  define_texture ("red", &MonoTexture::red);
+  define_texture ("green", &MonoTexture::green);
+  define_texture ("lightBlue", &MonoTexture::lightBlue);
+  define_texture ("blue", &MonoTexture::blue);
+  define_texture ("yellow", &MonoTexture::yellow);
+}
+
+void SceneParser::skip_blanks ()
+{
+  while (p < end)
+    {
+      if (*p == '\n')
+	line++;
+      else if (*p == '#')
+	{
+	  while (p < end && *p != '\n')
+	    p++;
+	  continue;
+	}
+      else if (!isspace ((unsigned char) *p))
+	break;
+      p++;
+    }
+}
+
+// Move to the next word and return false at the end of the file.
+// Braces are words by themselves.
+bool SceneParser::next ()
+{
+  skip_blanks ();
+  word = p;
+  if (p < end && (*p == '{' || *p == '}'))
+    p++;
+  else
+    while (p < end && !isspace ((unsigned char) *p) && *p != '#'
+	   && *p != '{' && *p != '}')
+      p++;
+
+  word_len = p - word;
+  return word_len > 0;
+}
+
+// Return whether the next word looks like a number, without
+// consuming it.
+bool SceneParser::at_number ()
+{
+  skip_blanks ();
+  return p < end
+	 && (isdigit ((unsigned char) *p) || *p == '-' || *p == '+'
+	     || *p == '.');
+}
+
+void SceneParser::fail (const std::string &msg)
+{
+  if (error.empty ())
+    error = msg;
+  p = end;
+}
+
+bool SceneParser::expect_word (const char *what)
+{
+  if (next ())
+    return true;
+
+  fail (std::string ("expected ") + what + " at end of file");
+  return false;
+}
+
+real SceneParser::number ()
+{
+  if (!at_number ())
+    {
+      next ();
+      fail (word_len ? "expected a number instead of `" + name () + "'"
+	    : std::string ("expected a number at end of file"));
+      return 0;
+    }
+
+  // The buffer is null-terminated, so strtod stops at the end.
+  char *after;
+  double x = strtod (p, &after);
+  if (after == p
+      || (after < end && !isspace ((unsigned char) *after) && *after != '#'
+	  && *after != '{' && *after != '}'))
+    {
+      next ();
+      fail ("invalid number `" + name () + "'");
+      return 0;
+    }
+
+  p = after;
+  return (real) x;
+}
+
+Color SceneParser::color ()
+{
+  real r = number ();
+  real g = number ();
+  real b = number ();
+  return Color (r, g, b);
+}
+
+Point3D SceneParser::point ()
+{
+  real x = number ();
+  real y = number ();
+  real z = number ();
+  return Point3D (x, y, z);
+}
+
+Vector3D SceneParser::vector ()
+{
+  real x = number ();
+  real y = number ();
+  real z = number ();
+  return Vector3D (x, y, z);
+}
+
+std::string SceneParser::new_name ()
+{
+  if (!expect_word ("a name"))
+    return std::string ();
+  if (word[0] == '{' || word[0] == '}' || isdigit ((unsigned char) word[0])
+      || word[0] == '-' || word[0] == '+' || word[0] == '.')
+    fail ("invalid name `" + name () + "'");
+  return name ();
+}
+
+// Parse a list of operations between braces and compose them into T,
+// each one after the previous ones.
+bool SceneParser::transform (Transform &t)
+{
+  if (!expect_word ("{"))
+    return false;
+  if (!is ("{"))
+    {
+      fail ("expected { instead of `" + name () + "'");
+      return false;
+    }
+
+  for (;;)
+    {
+      if (!expect_word ("}"))
+	return false;
+      if (is ("}"))
+	return true;
+
+      if (is ("translate"))
+	t = Transform::translate (vector ()) * t;
+      else if (is ("scale"))
+	{
+	  real x = number ();
+	  if (at_number ())
+	    {
+	      real y = number ();
+	      t = Transform::scale (x, y, number ()) * t;
+	    }
+	  else
+	    t = Transform::scale (x, x, x) * t;
+	}
+      else if (is ("rotate-x"))
+	t = Transform::rotate_x (number ()) * t;
+      else if (is ("rotate-y"))
+	t = Transform::rotate_y (number ()) * t;
+      else if (is ("rotate-z"))
+	t = Transform::rotate_z (number ()) * t;
+      else
+	{
+	  fail ("unknown transform `" + name () + "'");
+	  return false;
+	}
+    }
+}
+
+// Build a balanced tree of unions over ITEMS[FIRST] to ITEMS[LAST - 1],
+// splitting them at the median of their centers along the axis where
+// these are most spread, so that the operands of each union are close
+// to each other and rays can skip most of them.
+const Entity *SceneParser::make_union (std::vector<UnionItem> &items,
+				       size_t first, size_t last)
+{
+  if (last - first == 1)
+    return items[first].e;
+
+  Bounds centers;
+  for (size_t k = first; k < last; k++)
+    centers |= items[k].center;
+
+  Vector3D d = centers.hi - centers.lo;
+  int axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+  size_t mid = (first + last) / 2;
+  std::nth_element (items.begin () + first, items.begin () + mid,
+		    items.begin () + last, CenterLess (axis));
+
+  const Entity *a = make_union (items, first, mid);
+  const Entity *b = make_union (items, mid, last);
+  return &scene.own (Union (*a, *b));
+}
+
+const Entity *SceneParser::entity ()
+{
+  if (!expect_word ("an entity"))
+    return NULL;
+
+  if (is ("plane"))
+    {
+      real a = number ();
+      real b = number ();
+      real c = number ();
+      real d = number ();
+      return &scene.own (Plane (a, b, c, d));
+    }
+  else if (is ("sphere"))
+    {
+      Point3D c = point ();
+      return &scene.own (Sphere (c, number ()));
+    }
+  else if (is ("reverse-sphere"))
+    {
+      Point3D c = point ();
+      return &scene.own (ReverseSphere (c, number ()));
+    }
+  else if (is ("mesh"))
+    {
+      if (!expect_word ("a file name"))
+	return NULL;
+
+      std::string file = name ();
+      if (mesh_files)
+	{
+	  // The file is looked at before it is read, so that a change
+	  // made while it is read makes the cache stale.
+	  struct stat st;
+	  if (stat (file.c_str (), &st) == 0)
+	    {
+	      std::ostringstream oss;
+	      oss << (unsigned long long) st.st_size << ' '
+		  << (long long) st.st_mtime << ' ' << file << '\n';
+	      *mesh_files += oss.str ();
+	    }
+	}
+
+      std::ifstream is (file.c_str ());
+      TriangleMesh mesh;
+      std::string msg;
+      if (!is)
+	fail ("cannot read " + file);
+      else if (!read_obj (is, mesh, msg))
+	fail (file + ":" + msg);
+      if (!error.empty ())
+	return NULL;
+
+      mesh.build ();
+      return &scene.own (mesh);
+    }
+  else if (is ("difference"))
+    {
+      const Entity *obj = entity ();
+      const Entity *bite = obj ? entity () : NULL;
+      return bite ? &scene.own (Difference (*obj, *bite)) : NULL;
+    }
+  else if (is ("bounding-box"))
+    {
+      const Entity *obj = entity ();
+      const Entity *bbox = obj ? entity () : NULL;
+      return bbox ? &scene.own (BoundingBox (*obj, *bbox)) : NULL;
+    }
+  else if (is ("instance"))
+    {
+      const Entity *obj = entity ();
+      Transform t;
+      if (!obj || !transform (t))
+	return NULL;
+      if (t.det () == 0)
+	{
+	  fail ("the transform of an instance must be invertible");
+	  return NULL;
+	}
+      return &scene.own (Instance (*obj, t));
+    }
+  else if (is ("union"))
+    {
+      if (!expect_word ("{"))
+	return NULL;
+      if (!is ("{"))
+	{
+	  fail ("expected { instead of `" + name () + "'");
+	  return NULL;
+	}
+
+      std::vector<UnionItem> items;
+      for (;;)
+	{
+	  skip_blanks ();
+	  if (p < end && *p == '}')
+	    break;
+
+	  UnionItem item;
+	  item.e = entity ();
+	  if (!item.e)
+	    return NULL;
+	  item.center = item.e->get_surface_bounds ().center ();
+	  items.push_back (item);
+	}
+
+      next ();
+      if (items.size () < 2)
+	{
+	  fail ("a union needs at least two entities");
+	  return NULL;
+	}
+
+      return make_union (items, 0, items.size ());
+    }
+
+  std::map<std::string, const Entity *>::const_iterator it
+    = entities.find (name ());
+  if (it == entities.end ())
+    {
+      fail ("unknown entity `" + name () + "'");
+      return NULL;
+    }
+
+  return it->second;
+}
+
+const AbstractLight *SceneParser::light ()
+{
+  if (!expect_word ("a light"))
+    return NULL;
+
+  bool shadows = true;
+  if (is ("noshadow"))
+    {
+      shadows = false;
+      if (!expect_word ("a light"))
+	return NULL;
+    }
+
+  if (is ("point"))
+    {
+      Point3D pos = point ();
+      Color c = at_number () ? color () : colors::white;
+      return &scene.own (Light (pos, c, shadows));
+    }
+  else if (is ("directed"))
+    {
+      Point3D pos = point ();
+      Vector3D dir = vector ();
+      Color c = color ();
+      return &scene.own (DirectedLight (pos, dir, c, shadows));
+    }
+  else if (is ("attenuated"))
+    {
+      real att = number ();
+      real strength = number ();
+      const AbstractLight *base = light ();
+      return base ? &scene.own (AttenuatedLight (*base, att, strength,
+						 shadows))
+		  : NULL;
+    }
+  else if (is ("bounded"))
+    {
+      const Entity *e = entity ();
+      const AbstractLight *base = e ? light () : NULL;
+      return base ? &scene.own (BoundedLight (*base, *e, shadows)) : NULL;
+    }
+
+  fail ("unknown light type `" + name () + "'");
+  return NULL;
+}
+
+int SceneParser::material ()
+{
+  if (!expect_word ("a material"))
+    return -1;
+  if (last_material != -1
+      && last_material_name.compare (0, std::string::npos,
+				     word, word_len) == 0)
+    return last_material;
+
+  std::map<std::string, int>::const_iterator it = materials.find (name ());
+  if (it == materials.end ())
+    {
+      fail ("unknown material `" + name () + "'");
+      return -1;
+    }
+
+  last_material_name = it->first;
+  last_material = it->second;
+  return last_material;
+}
+
+int SceneParser::texture ()
+{
+  if (!expect_word ("a texture"))
+    return -1;
+  if (last_texture != -1
+      && last_texture_name.compare (0, std::string::npos,
+				    word, word_len) == 0)
+    return last_texture;
+
+  std::map<std::string, int>::const_iterator it = textures.find (name ());
+  if (it == textures.end ())
+    {
+      fail ("unknown texture `" + name () + "'");
+      return -1;
+    }
+
+  last_texture_name = it->first;
+  last_texture = it->second;
+  return last_texture;
+}
+
+void SceneParser::parse_material ()
+{
+  std::string n = new_name ();
+  real x[9] = { 0.0, 1.0, 0.0, 0.0, 0.0, 1.0, 0.15, 20, 5 };
+  for (int k = 0; k < 9 && at_number (); k++)
+    x[k] = number ();
+
+  materials[n] = material_list.size ();
+  material_list.push_back (&scene.own (Material (x[0], x[1], x[2], x[3],
+						 x[4], x[5], x[6], (int) x[7],
+						 (int) x[8])));
+  last_material = -1;
+}
+
+void SceneParser::define_texture (const std::string &n, const Texture *t)
+{
+  textures[n] = texture_list.size ();
+  texture_list.push_back (t);
+  last_texture = -1;
+}
+
+void SceneParser::parse_texture ()
+{
+  std::string n = new_name ();
+  if (!expect_word ("a texture type"))
+    return;
+
+  if (is ("mono"))
+    define_texture (n, &scene.own (MonoTexture (color ())));
+  else if (is ("checker"))
+    {
+      Color a = color ();
+      Color b = color ();
+      real scale = at_number () ? number () : 1.0;
+      define_texture (n, &scene.own (CheckerTexture (a, b, scale)));
+    }
+  else
+    fail ("unknown texture type `" + name () + "'");
+}
+
+// If the object statement being parsed has an inline sphere, store it
+// in FLAT_SPHERES and return true.  Otherwise leave the input alone.
+bool SceneParser::flat_sphere ()
+{
+  const char *start = p;
+  int start_line = line;
+  if (!next () || !is ("sphere"))
+    {
+      p = start, line = start_line;
+      return false;
+    }
+
+  CachedSphere cs;
+  Point3D c = point ();
+  cs.x = c.x, cs.y = c.y, cs.z = c.z;
+  cs.r = number ();
+  cs.material = material ();
+  cs.texture = cs.material != -1 ? texture () : -1;
+  if (cs.texture != -1)
+    flat_spheres->push_back (cs);
+  return true;
+}
+
+void SceneParser::statement ()
+{
+  if (is ("object"))
+    {
+      if (flat_spheres && flat_sphere ())
+	return;
+
+      const Entity *e = entity ();
+      int m = e ? material () : -1;
+      int t = m != -1 ? texture () : -1;
+      if (t != -1)
+	scene.add_object (*e, *material_list[m], *texture_list[t]);
+    }
+  else if (is ("light"))
+    {
+      const AbstractLight *l = light ();
+      if (l)
+	scene.add_light (*l);
+    }
+  else if (is ("entity"))
+    {
+      std::string n = new_name ();
+      const Entity *e = error.empty () ? entity () : NULL;
+      if (e)
+	entities[n] = e;
+    }
+  else if (is ("material"))
+    parse_material ();
+  else if (is ("texture"))
+    parse_texture ();
+  else if (is ("ambient"))
+    scene.ambient = number ();
+  else if (is ("camera"))
+    {
+      Point3D source = point ();
+      settings.camera = Ray3D (source, vector ());
+    }
+  else if (is ("size"))
+    {
+      real w = number ();
+      real h = number ();
+      if (w < 1 || h < 1)
+	fail ("invalid image size");
+      settings.width = (int) w;
+      settings.height = (int) h;
+    }
+  else
+    fail ("unknown statement `" + name () + "'");
+}
+
+bool SceneParser::parse (std::string &error_msg)
+{
+  while (next ())
+    {
+      const char *start = word;
+      size_t n_spheres = flat_spheres ? flat_spheres->size () : 0;
+      statement ();
+      if (rest && flat_spheres->size () == n_spheres)
+	{
+	  rest->append (start, p);
+	  rest->push_back ('\n');
+	}
+    }
+
+  error_msg = error;
+  return error.empty ();
+}
+
+// Read all of F into BUF, followed by a null character.
+bool read_file (FILE *f, std::vector<char> &buf)
+{
+  size_t size = 0;
+  buf.resize (65536);
+  for (;;)
+    {
+      size += fread (&buf[size], 1, buf.size () - size, f);
+      if (size < buf.size ())
+	break;
+      buf.resize (buf.size () * 2);
+    }
+
+  buf.resize (size + 1);
+  buf[size] = '\0';
+  return !ferror (f);
+}
+
+// The header of a scene cache.  Offsets are counted from the start of
+// the file, so that it can be mapped at any address, and each section
+// is aligned to CACHE_ALIGN bytes.  The version changes whenever the
+// layout does, and the sizes make sure that the program agrees with
+// the cache on the size of real and on the layout of the BVH.  The
+// files of meshes are listed with their size and modification time,
+// since the BVH is built from their triangles.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version, byte_order, real_size, node_size, lanes, reserved;
+  uint64_t size;
+  uint64_t text_offset, text_size;	// the text ends with a null
+  uint64_t spheres_offset, n_spheres;
+  uint64_t nodes_offset, n_nodes;
+  uint64_t prims_offset, n_prims;
+  uint64_t columns_offset[4];		// cx, cy, cz and r2
+  uint64_t flags_offset;
+  uint64_t files_offset, files_size;	// the list ends with a null
+};
+
+const char cache_magic[8] = "PTGENSC";
+const uint32_t cache_version = 3;
+const uint32_t cache_byte_order = 0x01020304;
+const size_t cache_align = 64;
+
+// Pad BUF to CACHE_ALIGN bytes, append the N bytes at DATA and return
+// their offset.
+uint64_t append_section (std::vector<char> &buf, const void *data, size_t n)
+{
+  buf.resize ((buf.size () + cache_align - 1) & ~(cache_align - 1));
+  uint64_t offset = buf.size ();
+  const char *p = static_cast <const char *> (data);
+  buf.insert (buf.end (), p, p + n);
+  return offset;
+}
+
+// Return whether a section of N elements of SIZE bytes at OFFSET fits
+// in a cache of FILE_SIZE bytes.
+bool section_ok (uint64_t offset, uint64_t n, size_t size, uint64_t file_size)
+{
+  return offset % cache_align == 0 && offset <= file_size
+	 && n <= (file_size - offset) / size;
+}
+
+bool is_cache (const char *data, size_t size)
+{
+  return size >= sizeof (cache_magic)
+	 && memcmp (data, cache_magic, sizeof (cache_magic)) == 0;
+}
+
+// Check that the files listed in FILES by SceneParser::flatten have
+// not changed.  Otherwise store the name of the first one that has in
+// CHANGED and return false.
+bool files_unchanged (const char *files, std::string &changed)
+{
+  std::istringstream iss (files);
+  unsigned long long size;
+  long long mtime;
+  std::string file;
+  while (iss >> size >> mtime >> file)
+    {
+      struct stat st;
+      if (stat (file.c_str (), &st) == -1
+	  || (unsigned long long) st.st_size != size
+	  || (long long) st.st_mtime != mtime)
+	{
+	  changed = file;
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+// Add the scene in the cache at DATA, which must stay valid as long
+// as SCENE, to SCENE.  If PREBUILT is true, also make it use the
+// acceleration structures that are in the cache.
+bool read_cache (const char *data, size_t size, const char *file_name,
+		 Scene &scene, SceneSettings &settings, std::string &error,
+		 bool prebuilt)
+{
+  CacheHeader h;
+  if (size < sizeof (h))
+    {
+      error = std::string (file_name) + ": truncated scene cache";
+      return false;
+    }
+
+  memcpy (&h, data, sizeof (h));
+  if (h.version != cache_version || h.byte_order != cache_byte_order
+      || h.real_size != sizeof (real) || h.node_size != sizeof (BVH::Node)
+      || h.lanes != SphereArray::lanes)
+    {
+      error = std::string (file_name)
+	      + ": scene cache made by a different version or build";
+      return false;
+    }
+
+  uint64_t n_columns = h.n_prims + SphereArray::lanes;
+  bool ok = h.size == size
+	    && section_ok (h.text_offset, h.text_size, 1, size)
+	    && h.text_size > 0 && data[h.text_offset + h.text_size - 1] == '\0'
+	    && section_ok (h.spheres_offset, h.n_spheres,
+			   sizeof (CachedSphere), size)
+	    && section_ok (h.nodes_offset, h.n_nodes, sizeof (BVH::Node), size)
+	    && section_ok (h.prims_offset, h.n_prims, sizeof (int), size)
+	    && section_ok (h.flags_offset, h.n_prims, 1, size)
+	    && section_ok (h.files_offset, h.files_size, 1, size)
+	    && h.files_size > 0
+	    && data[h.files_offset + h.files_size - 1] == '\0';
+  for (int k = 0; k < 4; k++)
+    ok = ok && section_ok (h.columns_offset[k], n_columns, sizeof (real),
+			   size);
+
+  if (!ok)
+    {
+      error = std::string (file_name) + ": corrupted scene cache";
+      return false;
+    }
+
+  std::string msg;
+  if (!files_unchanged (data + h.files_offset, msg))
+    {
+      error = std::string (file_name) + ": " + msg
+	      + " has changed since the scene cache was compiled";
+      return false;
+    }
+
+  // The rest of the scene is parsed as usual.  It has already been
+  // checked when the cache was made.
+  SceneParser parser (scene, settings, data + h.text_offset,
+		      h.text_size - 1);
+  if (!parser.parse (msg))
+    {
+      error = std::string (file_name) + ": " + msg;
+      return false;
+    }
+
+  const CachedSphere *cs =
+    reinterpret_cast <const CachedSphere *> (data + h.spheres_offset);
+  scene.reserve_objects (scene.get_object_count () + h.n_spheres);
+  for (uint64_t k = 0; k < h.n_spheres; k++)
+    {
+      if (cs[k].material < 0 || cs[k].material >= parser.n_materials ()
+	  || cs[k].texture < 0 || cs[k].texture >= parser.n_textures ())
+	{
+	  error = std::string (file_name) + ": corrupted scene cache";
+	  return false;
+	}
+
+      const Sphere &sphere = scene.own (Sphere (cs[k].x, cs[k].y, cs[k].z,
+						cs[k].r));
+      scene.add_object (sphere, parser.get_material (cs[k].material),
+			parser.get_texture (cs[k].texture));
+    }
+
+  if (prebuilt && h.n_nodes)
+    {
+      PreparedScene p;
+      p.nodes = reinterpret_cast <const BVH::Node *> (data + h.nodes_offset);
+      p.n_nodes = h.n_nodes;
+      p.prims = reinterpret_cast <const int *> (data + h.prims_offset);
+      p.n_prims = h.n_prims;
+      p.cx = reinterpret_cast <const real *> (data + h.columns_offset[0]);
+      p.cy = reinterpret_cast <const real *> (data + h.columns_offset[1]);
+      p.cz = reinterpret_cast <const real *> (data + h.columns_offset[2]);
+      p.r2 = reinterpret_cast <const real *> (data + h.columns_offset[3]);
+      p.is_sphere =
+	reinterpret_cast <const unsigned char *> (data + h.flags_offset);
+      scene.use_prepared (p);
+    }
+
+  return true;
+}
+
+#ifdef HAVE_MMAP
+// A file mapped in memory.  Like auto_ptr, copying it moves the mapping
+// to the copy, so that it can be given to Scene::own.
+class FileMapping {
+  mutable void *addr;
+  mutable size_t size;
+
+  FileMapping &operator = (const FileMapping &);
+
+ public:
+  FileMapping (void *addr_, size_t size_) : addr (addr_), size (size_) {}
+  FileMapping (const FileMapping &m) : addr (m.addr), size (m.size) {
+    m.addr = NULL;
+  }
+  ~FileMapping () {
+    if (addr)
+      munmap (addr, size);
+  }
+
+  const char *get () const { return static_cast <const char *> (addr); }
+};
+
+// Map the scene cache in FILE_NAME, whose pages can then be shared by
+// all the processes that render it, and add its scene to SCENE.
+bool map_cache (const char *file_name, Scene &scene, SceneSettings &settings,
+		std::string &error)
+{
+  int fd = open (file_name, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat (fd, &st) == -1)
+    {
+      if (fd != -1)
+	close (fd);
+      error = std::string ("cannot read ") + file_name;
+      return false;
+    }
+
+  void *addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (addr == MAP_FAILED)
+    {
+      error = std::string ("cannot map ") + file_name;
+      return false;
+    }
+
+  const FileMapping &m = scene.own (FileMapping (addr, st.st_size));
+  return read_cache (m.get (), st.st_size, file_name, scene, settings, error,
+		     true);
+}
+#endif
+
+} // namespace
+
+bool load_scene (const char *file_name, Scene &scene,
+		 SceneSettings &settings, std::string &error)
+{
+  bool to_stdin = strcmp (file_name, "-") == 0;
+  FILE *f = to_stdin ? stdin : fopen (file_name, "rb");
+
+#ifdef HAVE_MMAP
+  char magic[sizeof (cache_magic)];
+  if (f && !to_stdin && fread (magic, 1, sizeof (magic), f) == sizeof (magic)
+      && is_cache (magic, sizeof (magic)))
+    {
+      fclose (f);
+      return map_cache (file_name, scene, settings, error);
+    }
+  if (f && !to_stdin)
+    rewind (f);
+#endif
+
+  std::vector<char> buf;
+  bool ok = f && read_file (f, buf);
+  if (f && !to_stdin)
+    fclose (f);
+  if (!ok)
+    {
+      error = std::string ("cannot read ") + file_name;
+      return false;
+    }
+
+  // Without mmap, a cache is read into memory that the scene keeps.
+  if (is_cache (&buf[0], buf.size () - 1))
+    {
+      const std::vector<char> &data = scene.own (buf);
+      return read_cache (&data[0], data.size () - 1, file_name, scene,
+			 settings, error, true);
+    }
+
+  SceneParser parser (scene, settings, &buf[0], buf.size () - 1);
+  std::string msg;
+  if (parser.parse (msg))
+    return true;
+
+  std::ostringstream oss;
+  oss << file_name << ':' << parser.get_line () << ": " << msg;
+  error = oss.str ();
+  return false;
+}
+
+bool compile_scene (const char *file_name, const char *cache_name,
+		    std::string &error)
+{
+  FILE *f = strcmp (file_name, "-") == 0 ? stdin : fopen (file_name, "rb");
+  std::vector<char> buf;
+  bool ok = f && read_file (f, buf);
+  if (f && f != stdin)
+    fclose (f);
+  if (!ok)
+    {
+      error = std::string ("cannot read ") + file_name;
+      return false;
+    }
+  if (is_cache (&buf[0], buf.size () - 1))
+    {
+      error = std::string (file_name) + " is already a scene cache";
+      return false;
+    }
+
+  // Parse the file once, separating the spheres from the rest.
+  Scene scratch;
+  SceneSettings settings;
+  std::vector<CachedSphere> spheres;
+  std::string text, files, msg;
+  SceneParser parser (scratch, settings, &buf[0], buf.size () - 1);
+  parser.flatten (spheres, text, files);
+  if (!parser.parse (msg))
+    {
+      std::ostringstream oss;
+      oss << file_name << ':' << parser.get_line () << ": " << msg;
+      error = oss.str ();
+      return false;
+    }
+
+  text.push_back ('\0');
+  files.push_back ('\0');
+  std::vector<char>().swap (buf);
+
+  CacheHeader h;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, cache_magic, sizeof (cache_magic));
+  h.version = cache_version;
+  h.byte_order = cache_byte_order;
+  h.real_size = sizeof (real);
+  h.node_size = sizeof (BVH::Node);
+  h.lanes = SphereArray::lanes;
+
+  std::vector<char> out (sizeof (h));
+  h.text_offset = append_section (out, text.data (), text.size ());
+  h.text_size = text.size ();
+  h.spheres_offset = append_section (out, spheres.empty () ? NULL : &spheres[0],
+				     spheres.size () * sizeof (CachedSphere));
+  h.n_spheres = spheres.size ();
+  h.files_offset = append_section (out, files.data (), files.size ());
+  h.files_size = files.size ();
+  h.size = out.size ();
+  memcpy (&out[0], &h, sizeof (h));
+  std::vector<CachedSphere>().swap (spheres);
+
+  // Build the acceleration structures for the scene exactly as it will
+  // be read back from the cache, so that the objects are the same and
+  // in the same order.
+  Scene scene;
+  PreparedScene p;
+  if (!read_cache (&out[0], out.size (), cache_name, scene, settings, error,
+		   false))
+    return false;
+  scene.get_prepared (p);
+
+  size_t n_columns = p.n_prims + SphereArray::lanes;
+  h.nodes_offset = append_section (out, p.nodes,
+				   p.n_nodes * sizeof (BVH::Node));
+  h.n_nodes = p.n_nodes;
+  h.prims_offset = append_section (out, p.prims, p.n_prims * sizeof (int));
+  h.n_prims = p.n_prims;
+  h.columns_offset[0] = append_section (out, p.cx, n_columns * sizeof (real));
+  h.columns_offset[1] = append_section (out, p.cy, n_columns * sizeof (real));
+  h.columns_offset[2] = append_section (out, p.cz, n_columns * sizeof (real));
+  h.columns_offset[3] = append_section (out, p.r2, n_columns * sizeof (real));
+  h.flags_offset = append_section (out, p.is_sphere, p.n_prims);
+  h.size = out.size ();
+  memcpy (&out[0], &h, sizeof (h));
+
+  std::ofstream os (cache_name, std::ofstream::binary);
+  if (!os.write (&out[0], out.size ()) || !os.flush ())
+    {
+      error = std::string ("cannot write ") + cache_name;
+      return false;
+    }
+
+  return true;
+}
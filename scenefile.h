@@ -0,0 +1,91 @@
+// Example ray tracing program
+// Scene description files
+
+#ifndef PTGEN_SCENEFILE_H
+#define PTGEN_SCENEFILE_H
+
+#include "config.h"
+#include "v3d.h"
+
+#include <string>
+
+class Scene;
+
+// What a scene file says besides the contents of the scene: where the
+// camera is and the default size of the image.
+struct SceneSettings {
+  Ray3D camera;
+  int width, height;
+
+  SceneSettings () :
+    camera (Point3D (0, 5, -20), Vector3D (0, 0, 1)),
+    width (320), height (240) {}
+};
+
+// Read the scene description in FILE_NAME ("-" is standard input) and
+// add its objects and lights to SCENE, which owns everything that is
+// created.  A scene file is a sequence of words and numbers separated
+// by blanks, with comments from # to the end of the line:
+//
+//   ambient A
+//   camera X Y Z DX DY DZ
+//   size WIDTH HEIGHT
+//   material NAME [AMBIENT DIFFUSE SPECULAR REFLECTIVE REFRACTIVE IOR
+//		    ABSORBANCE REFLECTIVITY MAX_REF]
+//   texture NAME mono R G B
+//   texture NAME checker R1 G1 B1 R2 G2 B2 [SCALE]
+//   entity NAME ENTITY
+//   object ENTITY MATERIAL TEXTURE
+//   light LIGHT
+//
+// where ENTITY is the name of an entity or one of
+//
+//   plane A B C D
+//   sphere X Y Z R
+//   reverse-sphere X Y Z R
+//   mesh FILE
+//   union { ENTITY ENTITY... }
+//   difference ENTITY BITE
+//   bounding-box ENTITY BOX
+//   instance ENTITY { TRANSFORM... }
+//
+// and LIGHT, optionally preceded by noshadow, is one of
+//
+//   point X Y Z [R G B]
+//   directed X Y Z DX DY DZ R G B
+//   attenuated ATTENUATION STRENGTH LIGHT
+//   bounded ENTITY LIGHT
+//
+// FILE is a Wavefront OBJ file, see read_obj; its name is relative to
+// the current directory.  TRANSFORM is one of translate X Y Z, scale S,
+// scale X Y Z, rotate-x A, rotate-y A and rotate-z A, with angles in
+// degrees; each one is applied after the ones before it.
+//
+// Materials take as many numbers as given, in the order of Material's
+// constructor.  The textures black, white, red, green, lightBlue, blue
+// and yellow are predefined.  Names must be defined before they are
+// used.
+//
+// The file is read in a single pass, so that even scenes with millions
+// of objects load quickly.  FILE_NAME can also be a scene cache made by
+// compile_scene.  Return false and store a message in ERROR if the file
+// cannot be read or has an error.
+bool load_scene (const char *file_name, Scene &scene,
+		 SceneSettings &settings, std::string &error);
+
+// Compile the scene file FILE_NAME into a scene cache called CACHE_NAME,
+// a binary file that holds the spheres of object statements as a flat
+// array, the rest of the scene as text, and the acceleration structures
+// of Scene::prepare; meshes are read again from their files.  The cache
+// is mapped in memory when it is loaded, and the acceleration structures
+// are used in place, so that the pages are shared by all the processes
+// that render it.  A cache can only be
+// used by a build of the program with the same layout and precision;
+// it must be compiled again when the scene file changes, and is
+// rejected if the size or modification time of the file of one of its
+// meshes has changed.  Return false
+// and store a message in ERROR if there is an error.
+bool compile_scene (const char *file_name, const char *cache_name,
+		    std::string &error);
+
+#endif
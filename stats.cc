@@ -0,0 +1,57 @@
+// Example ray tracing program
+// Optional counters of the work done by the tracer
+
+#include "config.h"
+#include "stats.h"
+
+#include <cstring>
+
+#ifdef ENABLE_STATS
+STATS_THREAD TraceStats *current_stats;
+#endif
+
+static const char *const entity_names[STATS_N_ENTITIES] = {
+  "Plane", "Sphere", "BoundingBox", "Difference", "Union", "Triangle"
+};
+
+void TraceStats::clear ()
+{
+  reflected_rays = refracted_rays = inside_calls = 0;
+  std::memset (tests, 0, sizeof (tests));
+  std::memset (hits, 0, sizeof (hits));
+  std::memset (depth, 0, sizeof (depth));
+}
+
+TraceStats &TraceStats::operator += (const TraceStats &s)
+{
+  reflected_rays += s.reflected_rays;
+  refracted_rays += s.refracted_rays;
+  inside_calls += s.inside_calls;
+  for (int k = 0; k < STATS_N_ENTITIES; k++)
+    {
+      tests[k] += s.tests[k];
+      hits[k] += s.hits[k];
+    }
+  for (int k = 0; k <= max_depth; k++)
+    depth[k] += s.depth[k];
+  return *this;
+}
+
+void TraceStats::print (std::ostream &os) const
+{
+  os << "reflected rays: " << reflected_rays << "\n"
+     << "refracted rays: " << refracted_rays << "\n"
+     << "intersection tests (hits):\n";
+  for (int k = 0; k < STATS_N_ENTITIES; k++)
+    if (tests[k])
+      os << "  " << entity_names[k] << ": " << tests[k]
+	 << " (" << hits[k] << ")\n";
+
+  os << "hits by recursion depth:\n";
+  for (int k = 0; k <= max_depth; k++)
+    if (depth[k])
+      os << "  " << k << (k == max_depth ? "+" : "") << ": "
+	 << depth[k] << "\n";
+
+  os << "CSG inside () calls: " << inside_calls << "\n";
+}
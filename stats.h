@@ -0,0 +1,72 @@
+// Example ray tracing program
+// Optional counters of the work done by the tracer
+
+#ifndef PTGEN_STATS_H
+#define PTGEN_STATS_H
+
+#include "config.h"
+
+#include <algorithm>
+#include <iostream>
+
+// The kinds of entity for which intersection tests are counted.
+// ReverseSphere is counted together with Sphere.
+enum stats_entity {
+  STATS_PLANE,
+  STATS_SPHERE,
+  STATS_BOUNDING_BOX,
+  STATS_DIFFERENCE,
+  STATS_UNION,
+  STATS_TRIANGLE,
+  STATS_N_ENTITIES
+};
+
+// Counters that are only updated if the program was configured with
+// --enable-stats; otherwise the STATS_* macros below expand to nothing.
+// Each rendering thread has its own counters, which are summed when
+// the rendering is over.
+struct TraceStats {
+  enum { max_depth = 16 };
+
+  long reflected_rays;
+  long refracted_rays;
+  long tests[STATS_N_ENTITIES];
+  long hits[STATS_N_ENTITIES];
+
+  // Number of hits shaded at each recursion depth, where 0 is the hit
+  // of a camera ray; deeper hits are counted in the last element.
+  long depth[max_depth + 1];
+
+  // Calls to inside () made by the CSG entities.
+  long inside_calls;
+
+  TraceStats () { clear (); }
+
+  void clear ();
+  TraceStats &operator += (const TraceStats &s);
+  void print (std::ostream &os) const;
+};
+
+#ifdef ENABLE_STATS
+#ifdef HAVE_PTHREAD
+#define STATS_THREAD __thread
+#else
+#define STATS_THREAD
+#endif
+
+// The counters of the running thread, or NULL if it is not rendering.
+extern STATS_THREAD TraceStats *current_stats;
+
+#define STATS_ADD(field, n) \
+  (current_stats ? (void) (current_stats->field += (n)) : (void) 0)
+#else
+#define STATS_ADD(field, n) ((void) 0)
+#endif
+
+#define STATS_INC(field)	STATS_ADD (field, 1)
+#define STATS_TEST(kind)	STATS_INC (tests[kind])
+#define STATS_HIT(kind)		STATS_INC (hits[kind])
+#define STATS_DEPTH(level) \
+  STATS_INC (depth[std::min ((int) (level), (int) TraceStats::max_depth)])
+
+#endif
@@ -4,10 +4,27 @@
 #include "texture.h"
 #include "light.h"
 
+#include <typeinfo>
+
 Texture::~Texture ()
 {
 }
 
+texture_kind get_texture_kind (const Texture &t)
+{
+  if (typeid (t) == typeid (MonoTexture))
+    return TEXTURE_MONO;
+  else if (typeid (t) == typeid (CheckerTexture))
+    return TEXTURE_CHECKER;
+  else
+    return TEXTURE_OTHER;
+}
+
+Color Texture::get_color (const Intersection &i, const Point3D &p3d) const
+{
+  return get_color (p3d, *i.entity);
+}
+
 Color MonoTexture::get_color (const Point3D &p3d, const Entity &e) const
 {
   return pigment;
@@ -20,6 +37,11 @@ Color UVTexture::get_color (const Point3D &p3d, const Entity &e) const
   return get_color (u, v);
 }
 
+Color UVTexture::get_color (const Intersection &i, const Point3D &p3d) const
+{
+  return get_color (i.entity->texture_u (i), i.entity->texture_v (i));
+}
+
 Color CheckerTexture::get_color (real u, real v) const
 {
   u /= scale;
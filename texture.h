@@ -22,8 +22,18 @@ namespace colors {
 struct Texture {
   virtual ~Texture ();
   virtual Color get_color (const Point3D &p3d, const Entity &e) const = 0;
+
+  // Return the color where I hits its entity, at P3D.  This is what the
+  // tracer calls; the default calls the version above.
+  virtual Color get_color (const Intersection &i, const Point3D &p3d) const;
 };
 
+// Textures whose exact type is known to the tracer, which then calls
+// their member functions directly instead of going through the vtable.
+enum texture_kind { TEXTURE_OTHER, TEXTURE_MONO, TEXTURE_CHECKER };
+
+texture_kind get_texture_kind (const Texture &t);
+
 struct MonoTexture : Texture {
   Color pigment;
 
@@ -40,9 +50,13 @@ struct MonoTexture : Texture {
   static MonoTexture yellow;
 };
 
+// A texture that maps coordinates U and V to colors.  When it is given
+// an intersection, the coordinates come from Entity::texture_u and
+// texture_v for the intersection, so that meshes interpolate them.
 struct UVTexture : Texture {
   virtual Color get_color (real u, real v) const = 0;
   Color get_color (const Point3D &p3d, const Entity &e) const;
+  Color get_color (const Intersection &i, const Point3D &p3d) const;
 };
 
 struct CheckerTexture : UVTexture {
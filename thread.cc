@@ -0,0 +1,62 @@
+// Example ray tracing program
+// Thin wrappers around POSIX threads
+
+#include "config.h"
+#include "thread.h"
+
+#include <unistd.h>
+#include <sys/time.h>
+
+Thread::~Thread ()
+{
+}
+
+#ifdef HAVE_PTHREAD
+void *Thread::trampoline (void *arg)
+{
+  static_cast <Thread *> (arg)->run ();
+  return NULL;
+}
+
+void Thread::start ()
+{
+  // If the thread cannot be created, do the work on the caller's thread.
+  started = pthread_create (&tid, NULL, trampoline, this) == 0;
+  if (!started)
+    run ();
+}
+
+void Thread::join ()
+{
+  if (started)
+    pthread_join (tid, NULL);
+  started = false;
+}
+
+#else
+void Thread::start ()
+{
+  run ();
+}
+
+void Thread::join ()
+{
+}
+#endif
+
+int num_processors ()
+{
+#if defined HAVE_PTHREAD && defined _SC_NPROCESSORS_ONLN
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int) n;
+#else
+  return 1;
+#endif
+}
+
+double now ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
@@ -0,0 +1,106 @@
+// Example ray tracing program
+// Thin wrappers around POSIX threads
+
+#ifndef PTGEN_THREAD_H
+#define PTGEN_THREAD_H
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+// A mutual exclusion lock.  Without POSIX threads everything runs on
+// a single thread, so locking does nothing.
+class Mutex {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t m;
+#endif
+
+  Mutex (const Mutex &);
+  Mutex &operator = (const Mutex &);
+
+  friend class Condition;
+
+ public:
+#ifdef HAVE_PTHREAD
+  Mutex () { pthread_mutex_init (&m, NULL); }
+  ~Mutex () { pthread_mutex_destroy (&m); }
+  void lock () { pthread_mutex_lock (&m); }
+  void unlock () { pthread_mutex_unlock (&m); }
+#else
+  Mutex () {}
+  void lock () {}
+  void unlock () {}
+#endif
+};
+
+// Holds a Mutex for the lifetime of the object.
+class MutexLock {
+  Mutex &m;
+
+  MutexLock (const MutexLock &);
+  MutexLock &operator = (const MutexLock &);
+
+ public:
+  explicit MutexLock (Mutex &m_) : m (m_) { m.lock (); }
+  ~MutexLock () { m.unlock (); }
+};
+
+// A condition variable, waited for while holding a Mutex.  Without
+// POSIX threads nobody else could ever signal it, so waiting is an error
+// and the callers must be written so that it does not happen.
+class Condition {
+#ifdef HAVE_PTHREAD
+  pthread_cond_t c;
+#endif
+
+  Condition (const Condition &);
+  Condition &operator = (const Condition &);
+
+ public:
+#ifdef HAVE_PTHREAD
+  Condition () { pthread_cond_init (&c, NULL); }
+  ~Condition () { pthread_cond_destroy (&c); }
+  void wait (Mutex &m) { pthread_cond_wait (&c, &m.m); }
+  void broadcast () { pthread_cond_broadcast (&c); }
+#else
+  Condition () {}
+  void broadcast () {}
+#endif
+};
+
+// A thread of execution.  Subclasses provide run (); start () launches
+// it and join () waits for it to finish.  Without POSIX threads, start ()
+// simply calls run ().
+class Thread {
+#ifdef HAVE_PTHREAD
+  pthread_t tid;
+  bool started;
+
+  static void *trampoline (void *arg);
+#endif
+
+  Thread (const Thread &);
+  Thread &operator = (const Thread &);
+
+ public:
+#ifdef HAVE_PTHREAD
+  Thread () : started (false) {}
+#else
+  Thread () {}
+#endif
+  virtual ~Thread ();
+  virtual void run () = 0;
+
+  void start ();
+  void join ();
+};
+
+// Return the number of online processors, or 1 if it cannot be found.
+int num_processors ();
+
+// Return the wall clock time in seconds.
+double now ();
+
+#endif
@@ -0,0 +1,108 @@
+// Example ray tracing program
+// Work-stealing distribution of image tiles to threads
+
+#include "config.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <utility>
+
+// Spread the low 16 bits of X so that there is a zero between each bit.
+static unsigned long spread_bits (unsigned long x)
+{
+  x &= 0xFFFF;
+  x = (x | (x << 8)) & 0x00FF00FF;
+  x = (x | (x << 4)) & 0x0F0F0F0F;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+  return x;
+}
+
+static unsigned long morton_code (int x, int y)
+{
+  return spread_bits (x) | (spread_bits (y) << 1);
+}
+
+typedef std::pair<unsigned long, Tile> MortonTile;
+
+static bool morton_less (const MortonTile &a, const MortonTile &b)
+{
+  return a.first < b.first;
+}
+
+TileScheduler::TileScheduler (int width, int first_row, int last_row,
+			      int tile_size, int n_threads)
+{
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int first_y = first_row / tile_size;
+  int last_y = (last_row + tile_size - 1) / tile_size;
+
+  std::vector<MortonTile> order;
+  order.reserve (tiles_x * (last_y - first_y));
+  for (int ty = first_y; ty < last_y; ty++)
+    for (int tx = 0; tx < tiles_x; tx++)
+      {
+	int x0 = tx * tile_size;
+	int y0 = ty * tile_size;
+	Tile t (x0, y0, std::min (x0 + tile_size, width),
+		std::min (y0 + tile_size, last_row));
+	order.push_back (std::make_pair (morton_code (tx, ty), t));
+      }
+
+  // Tile coordinates are unique, so there are no ties in the Morton code.
+  std::sort (order.begin (), order.end (), morton_less);
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  size_t n_tiles = order.size ();
+  for (int k = 0; k < n_threads; k++)
+    {
+      Queue *q = new Queue;
+      size_t first = n_tiles * k / n_threads;
+      size_t last = n_tiles * (k + 1) / n_threads;
+      for (size_t n = first; n < last; n++)
+	q->tiles.push_back (order[n].second);
+      queues.push_back (q);
+    }
+}
+
+TileScheduler::~TileScheduler ()
+{
+  for (size_t k = 0; k < queues.size (); k++)
+    delete queues[k];
+}
+
+bool TileScheduler::get_tile (int thread, Tile &t)
+{
+  Queue &q = *queues[thread];
+  {
+    MutexLock l (q.lock);
+    if (!q.tiles.empty ())
+      {
+	t = q.tiles.front ();
+	q.tiles.pop_front ();
+	return true;
+      }
+  }
+
+  return steal (thread, t);
+}
+
+bool TileScheduler::steal (int thread, Tile &t)
+{
+  int n = queues.size ();
+  for (int k = 1; k < n; k++)
+    {
+      Queue &victim = *queues[(thread + k) % n];
+      MutexLock l (victim.lock);
+      if (!victim.tiles.empty ())
+	{
+	  t = victim.tiles.back ();
+	  victim.tiles.pop_back ();
+	  return true;
+	}
+    }
+
+  return false;
+}
@@ -0,0 +1,59 @@
+// Example ray tracing program
+// Work-stealing distribution of image tiles to threads
+
+#ifndef PTGEN_TILES_H
+#define PTGEN_TILES_H
+
+#include "config.h"
+#include "thread.h"
+
+#include <deque>
+#include <vector>
+
+// The image is split into square tiles of this size, which are
+// distributed to the rendering threads by a TileScheduler.
+const int tile_size = 32;
+
+// A rectangle of pixels, from (x0, y0) included to (x1, y1) excluded.
+struct Tile {
+  int x0, y0, x1, y1;
+
+  Tile () : x0 (0), y0 (0), x1 (0), y1 (0) {}
+  Tile (int x0_, int y0_, int x1_, int y1_) :
+    x0 (x0_), y0 (y0_), x1 (x1_), y1 (y1_) {}
+};
+
+// Hands out the tiles of an image to a fixed number of threads.
+//
+// The tiles are sorted along a Morton (Z-order) curve and the curve is
+// cut into one contiguous run per thread, so that each thread works on
+// a compact area of the image.  A thread takes tiles from the front of
+// its own deque; when it is empty, it steals from the back of another
+// thread's deque, i.e. from the tiles that are farthest away from what
+// the victim is working on.
+class TileScheduler {
+  struct Queue {
+    Mutex lock;
+    std::deque<Tile> tiles;
+  };
+
+  std::vector<Queue *> queues;
+
+  TileScheduler (const TileScheduler &);
+  TileScheduler &operator = (const TileScheduler &);
+
+  bool steal (int thread, Tile &t);
+
+ public:
+  // Split rows FIRST_ROW to LAST_ROW - 1 of an image that is WIDTH
+  // pixels wide.  FIRST_ROW must be a multiple of TILE_SIZE.
+  TileScheduler (int width, int first_row, int last_row, int tile_size,
+		 int n_threads);
+  ~TileScheduler ();
+
+  // Store in T the next tile for thread number THREAD.  Return false
+  // when all tiles have been handed out.
+  bool get_tile (int thread, Tile &t);
+};
+
+#endif
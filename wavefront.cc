@@ -0,0 +1,172 @@
+// Example ray tracing program
+// Tracing many rays together, one generation at a time
+
+#include "config.h"
+#include "scene.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+  // Orders hits by material and texture, so that hits that are shaded
+  // the same way are shaded one after another.  Ties are broken by
+  // index, so that the order does not depend on the sorting algorithm.
+  struct ByMaterial {
+    const std::vector<Intersection> &hits;
+
+    ByMaterial (const std::vector<Intersection> &hits_) : hits (hits_) {}
+
+    bool operator () (int a, int b) const {
+      const Object &oa = *hits[a].object, &ob = *hits[b].object;
+      if (&oa.m != &ob.m)
+	return &oa.m < &ob.m;
+      if (&oa.t != &ob.t)
+	return &oa.t < &ob.t;
+      return a < b;
+    }
+  };
+}
+
+// Trace the N camera rays in RAYS, and store their colors in OUT and
+// the objects that they hit (or NULL) in HIT.  Each wave of rays goes
+// through separate stages: closest hits are found a packet at a time,
+// the hits are sorted by material and their lights are looked up,
+// shadow rays are tested grouped by light, and finally the light is
+// added and the reflected and refracted rays form the next wave.  The
+// colors are summed at the end in the same order as shade () does.
+void Scene::trace_wave (TraceState &state, const Ray3D *rays, int n,
+			int max_ref, Color *out, const Object **hit) const
+{
+  WaveBuffers &b = state.wave;
+  int n_lights = compiled_lights.size ();
+  b.shadow_rays.resize (n_lights);
+
+  b.nodes.assign (n, WaveNode ());
+  b.wave.resize (n);
+  for (int k = 0; k < n; k++)
+    {
+      PendingRay r = { rays[k], max_ref, 1.0, colors::white, 0.0 };
+      b.wave[k].r = r;
+      b.wave[k].node = k;
+      hit[k] = NULL;
+    }
+
+  RayPacket p;
+  for (int level = 0; !b.wave.empty (); level++)
+    {
+      // Find the closest hits.  Rays past the end of the wave are
+      // inactive, but they are set anyway so that the packet holds
+      // no garbage.
+      b.hits.clear ();
+      b.hit_ray.clear ();
+      int n_rays = b.wave.size ();
+      for (int first = 0; first < n_rays; first += RayPacket::size)
+	{
+	  int count = std::min (n_rays - first, (int) RayPacket::size);
+	  for (int k = 0; k < RayPacket::size; k++)
+	    p.set_ray (k, b.wave[first + (k < count ? k : 0)].r.ray);
+
+	  PacketMask active = RayPacket::all () >> (RayPacket::size - count);
+	  compute_intersection (p, active);
+	  for (int k = 0; k < count; k++)
+	    if (p.entity[k])
+	      {
+		b.hits.push_back (Intersection (p, k));
+		b.hit_ray.push_back (first + k);
+		if (level == 0)
+		  hit[b.wave[first + k].node] = p.object[k];
+	      }
+	}
+
+      int n_hits = b.hits.size ();
+      b.order.resize (n_hits);
+      for (int k = 0; k < n_hits; k++)
+	b.order[k] = k;
+      std::sort (b.order.begin (), b.order.end (), ByMaterial (b.hits));
+
+      // Compute the ambient light and the direction and color of each
+      // light, and collect the shadow rays.
+      b.points.resize (n_hits);
+      b.light_dirs.resize (n_hits * n_lights);
+      b.light_colors.resize (n_hits * n_lights);
+      b.shadowed.assign (n_hits * n_lights, false);
+      for (int k = 0; k < n_hits; k++)
+	{
+	  int h = b.order[k];
+	  const Intersection &i = b.hits[h];
+	  const WaveRay &w = b.wave[b.hit_ray[h]];
+	  STATS_DEPTH (level);
+
+	  Color c (0.0, 0.0, 0.0);
+	  c += surface (w.r, i, b.points[h]);
+	  b.nodes[w.node].c = c;
+
+	  bool have_shadows = i.object->have_shadows;
+	  for (int light = 0; light < n_lights; light++)
+	    {
+	      real dist;
+	      int term = h * n_lights + light;
+	      UnitVector3D &dir = b.light_dirs[term];
+	      dir = to_light (b.points[h], light, dist, b.light_colors[term]);
+	      if (have_shadows && compiled_lights[light].l->cast_shadows)
+		{
+		  ShadowRay s = { NormRay3D (b.points[h].p, dir, 0.0001),
+				  dist - 0.0001, term };
+		  b.shadow_rays[light].push_back (s);
+		}
+	    }
+	}
+
+      for (int light = 0; light < n_lights; light++)
+	{
+	  std::vector<ShadowRay> &v = b.shadow_rays[light];
+	  for (size_t k = 0; k < v.size (); k++)
+	    b.shadowed[v[k].term] = occluded (state, light, v[k].r, v[k].tmax);
+	  v.clear ();
+	}
+
+      // Add the light that is not blocked, and emit the secondary rays.
+      b.next.clear ();
+      for (int k = 0; k < n_hits; k++)
+	{
+	  int h = b.order[k];
+	  const WaveRay &w = b.wave[b.hit_ray[h]];
+	  const Material &m = b.hits[h].object->m;
+	  int node = w.node;
+	  for (int light = 0; light < n_lights; light++)
+	    {
+	      int term = h * n_lights + light;
+	      if (!b.shadowed[term])
+		{
+		  Color diffuse, specular;
+		  light_terms (w.r.ray, m, b.points[h], b.light_dirs[term],
+			       b.light_colors[term], diffuse, specular);
+		  b.nodes[node].c += diffuse;
+		  b.nodes[node].c += specular;
+		}
+	    }
+
+	  Frame f;
+	  secondary (state, w.r, b.hits[h], b.points[h], f);
+	  for (int j = 0; j < f.n_next; j++)
+	    {
+	      WaveRay nw;
+	      nw.r = f.next[j];
+	      nw.node = b.nodes.size ();
+	      b.nodes[node].child[b.nodes[node].n_child++] = nw.node;
+	      b.nodes.push_back (WaveNode ());
+	      b.next.push_back (nw);
+	    }
+	}
+
+      b.wave.swap (b.next);
+    }
+
+  std::vector<WaveNode> &nodes = b.nodes;
+  for (int k = nodes.size (); --k >= 0; )
+    for (int j = 0; j < nodes[k].n_child; j++)
+      nodes[k].c += nodes[nodes[k].child[j]].c;
+
+  for (int k = 0; k < n; k++)
+    out[k] = nodes[k].c;
+}